@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <glob.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+
+// Longest manifest line, including its newline
+#define MANIFEST_LINE_LENGTH 8192
+
+// Appends a copy of input and output to *list, returns 0 if out of memory
+static int addEntry(batchList *list, const char *input, const char *output, int dpi);
+// Appends input to *list, written to outputDirectory under its own name with a .png extension
+static int addToDirectory(batchList *list, const char *input, const char *outputDirectory, int dpi);
+// Returns a non-zero value if the extension of name is one of the image formats that can be read
+static int isImageName(const char *name);
+// qsort() comparator for an array of strings
+static int compareNames(const void *a, const void *b);
+// qsort() and bsearch() comparator for an array of fileIdentity, by device and inode only
+static int compareIdentities(const void *a, const void *b);
+// Returns a non-zero value after printing it if an existing output of *list is the input of another entry
+static int overwritesInput(const batchList *list);
+
+// Device and inode of the input of an entry, whatever path names it
+typedef struct
+{
+    dev_t device;
+    ino_t inode;
+    size_t entry;
+} fileIdentity;
+
+int batchFromDirectory(batchList *list, const char *directory, const char *outputDirectory, int dpi)
+{
+    DIR *handle = opendir(directory);
+    if (handle == NULL)
+    {
+        return 0;
+    }
+    char **names = NULL;
+    size_t count = 0,
+           capacity = 0;
+    int listed = 1;
+    struct dirent *entry;
+    while (listed && (entry = readdir(handle)) != NULL)
+    {
+        if (isImageName(entry->d_name) == 0)
+        {
+            continue;
+        }
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity*2 : 64;
+            char **grown = realloc(names, sizeof(char*)*capacity);
+            if (grown == NULL)
+            {
+                listed = 0;
+                break;
+            }
+            names = grown;
+        }
+        // Room for the directory, a separator, the name and its terminator
+        names[count] = malloc(strlen(directory)+strlen(entry->d_name)+2);
+        if (names[count] == NULL)
+        {
+            listed = 0;
+            break;
+        }
+        sprintf(names[count++], "%s/%s", directory, entry->d_name);
+    }
+    closedir(handle);
+
+    // readdir() order depends on the file system, pages are expected in name order
+    qsort(names, count, sizeof(char*), compareNames);
+    for (size_t i = 0; i < count; i++)
+    {
+        listed = listed && addToDirectory(list, names[i], outputDirectory, dpi);
+        free(names[i]);
+    }
+    free(names);
+    return listed;
+}
+
+int batchFromGlob(batchList *list, const char *pattern, const char *outputDirectory, int dpi)
+{
+    glob_t matches;
+    if (glob(pattern, 0, NULL, &matches) != 0)
+    {
+        return 0;
+    }
+    int listed = 1;
+    for (size_t i = 0; i < matches.gl_pathc && listed; i++)
+    {
+        listed = addToDirectory(list, matches.gl_pathv[i], outputDirectory, dpi);
+    }
+    globfree(&matches);
+    return listed;
+}
+
+int batchFromManifest(batchList *list, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        printf("Error opening manifest %s\n", path);
+        return 0;
+    }
+    char line[MANIFEST_LINE_LENGTH];
+    int number = 0;
+    int listed = 1;
+    while (listed && fgets(line, sizeof(line), file) != NULL)
+    {
+        number++;
+        size_t length = strlen(line);
+        if (length+1 == sizeof(line) && line[length-1] != '\n')
+        {
+            printf("Manifest line %i is too long\n", number);
+            listed = 0;
+            break;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+        {
+            continue;
+        }
+        // Fields are split on tabs only, so paths may contain spaces
+        char *input  = strtok(line, "\t"),
+             *output = strtok(NULL, "\t"),
+             *dpi    = strtok(NULL, "\t");
+        if (input == NULL || output == NULL || dpi == NULL || atoi(dpi) <= 0)
+        {
+            printf("Invalid manifest line %i, expected input, output and DPI separated by tabs\n", number);
+            listed = 0;
+            break;
+        }
+        listed = addEntry(list, input, output, atoi(dpi));
+    }
+    fclose(file);
+    return listed;
+}
+
+int batchCheckOutputs(const batchList *list)
+{
+    const char **outputs = malloc(sizeof(char*)*(list->count+1));
+    if (outputs == NULL)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < list->count; i++)
+    {
+        outputs[i] = list->entries[i].output;
+    }
+    // Sorting brings equal paths next to each other
+    qsort(outputs, list->count, sizeof(char*), compareNames);
+    int unique = 1;
+    for (size_t i = 1; i < list->count && unique; i++)
+    {
+        if (strcmp(outputs[i-1], outputs[i]) == 0)
+        {
+            printf("More than one image would be written to %s\n", outputs[i]);
+            unique = 0;
+        }
+    }
+    free(outputs);
+    return unique && overwritesInput(list) == 0;
+}
+
+int overwritesInput(const batchList *list)
+{
+    fileIdentity *inputs = malloc(sizeof(fileIdentity)*(list->count+1));
+    if (inputs == NULL)
+    {
+        return 1;
+    }
+    size_t count = 0;
+    struct stat status;
+    for (size_t i = 0; i < list->count; i++)
+    {
+        // Inputs that cannot be found fail on their own when they are read
+        if (stat(list->entries[i].input, &status) == 0)
+        {
+            inputs[count].device = status.st_dev;
+            inputs[count].inode = status.st_ino;
+            inputs[count].entry = i;
+            count++;
+        }
+    }
+    qsort(inputs, count, sizeof(fileIdentity), compareIdentities);
+    int overwrites = 0;
+    for (size_t i = 0; i < list->count && overwrites == 0; i++)
+    {
+        if (stat(list->entries[i].output, &status) != 0)
+        {
+            continue;
+        }
+        fileIdentity key = {status.st_dev, status.st_ino, i};
+        fileIdentity *found = bsearch(&key, inputs, count, sizeof(fileIdentity), compareIdentities);
+        if (found == NULL)
+        {
+            continue;
+        }
+        // An image may write over its own input, which it reads into memory first, but not over
+        // one another image may still be reading. Entries sharing an input sit next to each other.
+        while (found > inputs && compareIdentities(found-1, &key) == 0)
+        {
+            found--;
+        }
+        for (; found < inputs+count && compareIdentities(found, &key) == 0 && overwrites == 0; found++)
+        {
+            if (found->entry != i)
+            {
+                printf("Output %s would overwrite the input of %s\n", list->entries[i].output,
+                       list->entries[found->entry].input);
+                overwrites = 1;
+            }
+        }
+    }
+    free(inputs);
+    return overwrites;
+}
+
+void batchFree(batchList *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        free(list->entries[i].input);
+        free(list->entries[i].output);
+    }
+    free(list->entries);
+    list->entries = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+int addEntry(batchList *list, const char *input, const char *output, int dpi)
+{
+    if (list->count == list->capacity)
+    {
+        size_t capacity = list->capacity ? list->capacity*2 : 64;
+        batchEntry *grown = realloc(list->entries, sizeof(batchEntry)*capacity);
+        if (grown == NULL)
+        {
+            return 0;
+        }
+        list->entries = grown;
+        list->capacity = capacity;
+    }
+    batchEntry *entry = &list->entries[list->count];
+    entry->input  = strdup(input);
+    entry->output = strdup(output);
+    entry->dpi    = dpi;
+    if (entry->input == NULL || entry->output == NULL)
+    {
+        free(entry->input);
+        free(entry->output);
+        return 0;
+    }
+    list->count++;
+    return 1;
+}
+
+int addToDirectory(batchList *list, const char *input, const char *outputDirectory, int dpi)
+{
+    const char *name = strrchr(input, '/');
+    name = name != NULL ? name+1 : input;
+    const char *extension = strrchr(name, '.');
+    size_t stem = extension != NULL && extension != name ? (size_t)(extension-name) : strlen(name);
+
+    // Room for the directory, a separator, the stem, ".png" and the terminator
+    char *output = malloc(strlen(outputDirectory)+stem+6);
+    if (output == NULL)
+    {
+        return 0;
+    }
+    sprintf(output, "%s/%.*s.png", outputDirectory, (int)stem, name);
+    int added = addEntry(list, input, output, dpi);
+    free(output);
+    return added;
+}
+
+int isImageName(const char *name)
+{
+    static const char *extensions[] = {".png", ".jpg", ".jpeg", ".bmp", ".tga", ".gif", ".psd", ".pgm", ".ppm", ".pnm"};
+    const char *extension = strrchr(name, '.');
+    if (extension == NULL || extension == name)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(extensions)/sizeof(extensions[0]); i++)
+    {
+        if (strcasecmp(extension, extensions[i]) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int compareNames(const void *a, const void *b)
+{
+    return strcmp(*(char * const*)a, *(char * const*)b);
+}
+
+int compareIdentities(const void *a, const void *b)
+{
+    const fileIdentity *first = a, *second = b;
+    if (first->device != second->device)
+    {
+        return first->device < second->device ? -1 : 1;
+    }
+    return first->inode < second->inode ? -1 : first->inode > second->inode;
+}
@@ -0,0 +1,46 @@
+#ifndef BATCH_H_INCLUDED
+#define BATCH_H_INCLUDED
+
+#include <stddef.h>
+
+// Single image of a batch, input and output are owned by the batchList
+typedef struct
+{
+    char *input;
+    char *output;
+    int dpi;
+} batchEntry;
+
+// Images descreened by a batch run, in the order they were listed
+typedef struct
+{
+    batchEntry *entries;
+    size_t count;
+    size_t capacity;
+} batchList;
+
+// batchFromDirectory() will add every image file (by extension) in directory to *list, sorted by name,
+// each written to outputDirectory under the same name with a .png extension and descreened at dpi.
+// It will return a non-zero value on success.
+int batchFromDirectory(batchList *list, const char *directory, const char *outputDirectory, int dpi);
+
+// batchFromGlob() will add every path matching the glob pattern to *list, each written to
+// outputDirectory like batchFromDirectory() does. It will return a non-zero value on success,
+// or 0 if nothing matches.
+int batchFromGlob(batchList *list, const char *pattern, const char *outputDirectory, int dpi);
+
+// batchFromManifest() will add the entries of the manifest file at path to *list, one per line
+// as an input path, an output path and a DPI separated by tabs. Empty lines and lines starting
+// with # are skipped. It will return a non-zero value on success, after printing the first invalid line otherwise.
+int batchFromManifest(batchList *list, const char *path);
+
+// batchCheckOutputs() will make sure no two entries of *list are written to the same path and that no
+// existing output is the input of another entry (by any name), so images descreened at once never write
+// the same file or one still being read. It will return a non-zero value on success, after printing
+// the first conflict otherwise.
+int batchCheckOutputs(const batchList *list);
+
+// batchFree() will free every entry of *list and leave it empty
+void batchFree(batchList *list);
+
+#endif // BATCH_H_INCLUDED
@@ -0,0 +1,755 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef M_PI
+    #define M_PI 3.14159265358979323846
+#endif
+
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_FAILURE_USERMSG
+#include "stb_image.h"
+#include "descreen.h"
+#include "imageio.h"
+
+// Benchmarks analyzeGrid() and descreen(), either with every transform strategy on an image file,
+// checking that the strategies agree on the detected screentone and the descreened output, or on
+// synthetic AM halftones whose screen is known, across window sizes and thread counts.
+// With --verify it instead checks the detections on a fixed set of synthetic halftones,
+// with --verify-large on a halftone mapped from past 2^31 bytes into a sparse file.
+
+// Largest number of thread counts a synthetic run compares
+#define MAX_THREAD_COUNTS 16
+// Window size and image size of the halftones --verify checks
+#define VERIFY_POW2 9
+#define VERIFY_SIZE 1024
+// Distance between the rows of the --verify-large view, its VERIFY_SIZE rows span more than 2^31 bytes,
+// and where the view starts in its file, also past 2^31 bytes and not on a page boundary
+#define LARGE_STRIDE (((size_t)2<<20)+4096)
+#define LARGE_OFFSET (((off_t)1<<31)+1000)
+
+// Shape of the dots of a synthetic halftone
+typedef enum
+{
+    DOT_ROUND,
+    DOT_SQUARE,
+    DOT_LINE,
+    DOT_ELLIPSE
+} dotShape;
+
+// Parameters of a synthetic run
+typedef struct
+{
+    size_t width;
+    size_t height;
+    int components;
+    int dpi;
+    int lpi;
+    int angle;
+    dotShape dot;
+    int minPow2;
+    int maxPow2;
+    int threads[MAX_THREAD_COUNTS];
+    int threadCounts;
+    int iterations;
+    descreenTransform transform;
+} syntheticBench;
+
+// Screen of a halftone --verify checks
+typedef struct
+{
+    int components;
+    int lpi;
+    int angle;
+    dotShape dot;
+} verifyScreen;
+
+// Image held in memory, passed through descreenStream() a few rows at a time
+typedef struct
+{
+    unsigned char *pixels;
+    size_t rowBytes;
+    size_t row;
+} memoryRows;
+
+// Returns a monotonic timestamp in seconds
+static double now(void);
+// Benchmarks every transform strategy on the image at path, returns the program's exit status
+static int compareTransforms(const char *path, int dpi, int pow2, int iterations);
+// Generates the halftone described by *bench and benchmarks it, returns the program's exit status
+static int runSynthetic(const syntheticBench *bench);
+// Checks that analyze() and analyzeGrid() detect the screen of every halftone of verifyScreens and that
+// descreen() and descreenStream() filter them alike, every call without a context, returns the program's exit status
+static int verifyDetection(const syntheticBench *defaults);
+// Checks that analyze() and analyzeGrid() detect the screen of a gray halftone mapped with mapRawImage() from
+// a sparse file in directory, as a view whose rows start past 2^31 bytes into the file and lie more than
+// 2^31 bytes apart from first to last, and that descreen() filters the view like a packed copy of it.
+// Returns the program's exit status.
+static int verifyLargeOffsets(const syntheticBench *defaults, const char *directory);
+// descreenRowReader and descreenRowWriter copying rows out of and into a memoryRows
+static int readMemoryRows(void *data, unsigned char *pixels, size_t rows, ptrdiff_t stride);
+static int writeMemoryRows(void *data, const unsigned char *pixels, size_t rows, ptrdiff_t stride);
+// Fills pixels with a width x height halftone of a smoothly varying tone, screened at lpi and angle
+// with dots of the given shape, every component of a pixel is set to the same value
+static void generateHalftone(unsigned char *pixels, const syntheticBench *bench);
+// Returns the threshold of the spot function of dot at (u, v) within a cell, both in [-1, 1),
+// a pixel is inked when its darkness exceeds the threshold
+static double spotThreshold(dotShape dot, double u, double v);
+// Returns a non-zero value if lpi and angle are within the resolution of a 2^pow2 window of the
+// screen of *bench, angles are compared modulo 90 degrees
+static int matchesScreen(const syntheticBench *bench, int pow2, int lpi, int angle);
+// Parses a --dot value, returns 0 if it is not a known dot shape
+static int parseDot(const char *name, dotShape *dot);
+// Parses a comma separated list of thread counts, returns 0 if it is not one
+static int parseThreads(const char *list, syntheticBench *bench);
+
+// Halftones checked by --verify, gray and RGB with every dot shape, at common screen frequencies and
+// at angles both near and away from the axes. Coarser screens and line screens away from the axes are
+// left out, the strongest peak of their binary dots is a harmonic and analyze() reports that one.
+static const verifyScreen verifyScreens[] =
+{
+    {1,  85, 45, DOT_ROUND},
+    {3, 100, 20, DOT_ROUND},
+    {3, 133, 15, DOT_SQUARE},
+    {1, 150, 75, DOT_ELLIPSE},
+    {1, 100,  0, DOT_LINE},
+    {3,  85, 10, DOT_ROUND},
+    {3, 175, 45, DOT_ELLIPSE}
+};
+
+int main(int argc, char *argv[])
+{
+    syntheticBench bench = {0};
+    bench.width  = 2048;
+    bench.height = 2048;
+    bench.components = 3;
+    bench.dpi   = 600;
+    bench.lpi   = 100;
+    bench.angle = 20;
+    bench.dot   = DOT_ROUND;
+    bench.minPow2 = 7;
+    bench.maxPow2 = 12;
+    bench.threads[0] = 1;
+    bench.threadCounts = 1;
+    bench.iterations = 3;
+    bench.transform = DESCREEN_TRANSFORM_PLANAR;
+
+    // Options may appear anywhere, everything else is a positional argument
+    char *positional[4] = {NULL};
+    int positionalCount = 0,
+        verify = 0;
+    const char *largeDirectory = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        int valid = 1;
+        if (strcmp(argv[i], "--size") == 0 && i+1 < argc)
+        {
+            valid = sscanf(argv[++i], "%zux%zu", &bench.width, &bench.height) == 2 && bench.width > 0 && bench.height > 0;
+        } else if (strcmp(argv[i], "--components") == 0 && i+1 < argc)
+        {
+            bench.components = atoi(argv[++i]);
+            valid = bench.components == 1 || bench.components == 3;
+        } else if (strcmp(argv[i], "--dpi") == 0 && i+1 < argc)
+        {
+            bench.dpi = atoi(argv[++i]);
+            valid = bench.dpi > 0;
+        } else if (strcmp(argv[i], "--lpi") == 0 && i+1 < argc)
+        {
+            bench.lpi = atoi(argv[++i]);
+            valid = bench.lpi > 0;
+        } else if (strcmp(argv[i], "--angle") == 0 && i+1 < argc)
+        {
+            bench.angle = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--dot") == 0 && i+1 < argc)
+        {
+            valid = parseDot(argv[++i], &bench.dot);
+        } else if (strcmp(argv[i], "--pow2") == 0 && i+1 < argc)
+        {
+            // A single size or an inclusive range, e.g. 9 or 7-12
+            i++;
+            int fields = sscanf(argv[i], "%d-%d", &bench.minPow2, &bench.maxPow2);
+            if (fields == 1)
+            {
+                bench.maxPow2 = bench.minPow2;
+            }
+            valid = fields >= 1 && bench.minPow2 >= 2 && bench.minPow2 <= bench.maxPow2 && bench.maxPow2 <= 14;
+        } else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+        {
+            valid = parseThreads(argv[++i], &bench);
+        } else if (strcmp(argv[i], "--iterations") == 0 && i+1 < argc)
+        {
+            bench.iterations = atoi(argv[++i]);
+            valid = bench.iterations > 0;
+        } else if (strcmp(argv[i], "--transform") == 0 && i+1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "planar") == 0)
+            {
+                bench.transform = DESCREEN_TRANSFORM_PLANAR;
+            } else if (strcmp(argv[i], "packed") == 0)
+            {
+                bench.transform = DESCREEN_TRANSFORM_PACKED;
+            } else
+            {
+                valid = 0;
+            }
+        } else if (strcmp(argv[i], "--verify") == 0)
+        {
+            verify = 1;
+        } else if (strcmp(argv[i], "--verify-large") == 0 && i+1 < argc)
+        {
+            largeDirectory = argv[++i];
+        } else if (strcmp(argv[i], "--help") == 0)
+        {
+            valid = 0;
+        } else if (positionalCount < 4)
+        {
+            positional[positionalCount++] = argv[i];
+        }
+        if (valid == 0)
+        {
+            printf("Usage: %s [options]\n", argv[0]);
+            printf("       %s [input] [DPI] [pow2 (default 9)] [iterations (default 3)]\n", argv[0]);
+            printf("       %s --verify [--threads count] [--transform type]\n", argv[0]);
+            printf("       %s --verify-large [directory] [--threads count] [--transform type]\n", argv[0]);
+            printf("Without an input, synthetic halftones are generated and benchmarked:\n");
+            printf("  --size [WxH]          Image size in pixels (default 2048x2048)\n");
+            printf("  --components [1|3]    Gray or RGB (default 3)\n");
+            printf("  --dpi [dpi]           Resolution of the image (default 600)\n");
+            printf("  --lpi [lpi]           Screen frequency (default 100)\n");
+            printf("  --angle [degrees]     Screen angle (default 20)\n");
+            printf("  --dot [shape]         Dot shape: round (default), square, line or ellipse\n");
+            printf("  --pow2 [n or min-max] Window sizes to compare (default 7-12)\n");
+            printf("  --threads [list]      Comma separated thread counts to compare (default 1)\n");
+            printf("  --iterations [count]  Runs of each measurement, the fastest is reported (default 3)\n");
+            printf("  --transform [type]    planar (default) or packed\n");
+            printf("  --verify              Check the detected screen of a fixed set of halftones, exits with 1 on any miss\n");
+            printf("  --verify-large [dir]  Check a halftone mapped from past 2^31 bytes into a sparse file made in dir\n");
+            return i < argc && strcmp(argv[i], "--help") == 0 ? 0 : 1;
+        }
+    }
+
+    if (verify)
+    {
+        return verifyDetection(&bench);
+    }
+    if (largeDirectory != NULL)
+    {
+        return verifyLargeOffsets(&bench, largeDirectory);
+    }
+    if (positionalCount >= 2)
+    {
+        int pow2 = positionalCount > 2 ? atoi(positional[2]) : 9,
+            iterations = positionalCount > 3 ? atoi(positional[3]) : 3;
+        return compareTransforms(positional[0], atoi(positional[1]), pow2, iterations > 0 ? iterations : 1);
+    }
+    return runSynthetic(&bench);
+}
+
+int compareTransforms(const char *path, int dpi, int pow2, int iterations)
+{
+    int width, height, comp;
+    unsigned char *pixels = stbi_load(path, &width, &height, &comp, 3);
+    if (pixels == NULL)
+    {
+        printf("Error reading image %s: %s\n", path, stbi_failure_reason());
+        return 1;
+    }
+    size_t imageSize = (size_t)width*height*3;
+    double megapixels = (double)width*height/1e6;
+    unsigned char *work = malloc(imageSize),
+                  *reference = malloc(imageSize);
+    if (work == NULL || reference == NULL)
+    {
+        printf("Error allocating image buffers\n");
+        return 1;
+    }
+
+    const char *names[2] = {"planar", "packed"};
+    descreenTransform transforms[2] = {DESCREEN_TRANSFORM_PLANAR, DESCREEN_TRANSFORM_PACKED};
+    printf("%ix%i, %.2f megapixels, %ix%i windows, best of %i\n", width, height, megapixels, 1 << pow2, 1 << pow2, iterations);
+    printf("%-8s %14s %14s %10s %10s\n", "", "analyze (ms)", "descreen (ms)", "MP/s", "max diff");
+    for (int strategy = 0; strategy < 2; strategy++)
+    {
+        // Plans are made before timing starts, they are reused by every iteration
+        descreenContext *context = descreenCreateContext();
+        descreenConfig config = {0};
+        config.context = context;
+        config.pixels = pixels;
+        config.width  = width;
+        config.height = height;
+        config.dpi    = dpi;
+        config.transform = transforms[strategy];
+        descreenScreenMap map;
+        analyzeGrid(&config, pow2, 0, 0, &map);
+        freeScreenMap(&map);
+
+        double bestAnalyze = -1,
+               bestDescreen = -1;
+        int found = 0;
+        for (int iteration = 0; iteration < iterations; iteration++)
+        {
+            config.pixels = pixels;
+            double start = now();
+            found = analyzeGrid(&config, pow2, 0, 0, &map);
+            double elapsed = now()-start;
+            freeScreenMap(&map);
+            if (bestAnalyze < 0 || elapsed < bestAnalyze)
+            {
+                bestAnalyze = elapsed;
+            }
+
+            if (found)
+            {
+                memcpy(work, pixels, imageSize);
+                config.pixels = work;
+                start = now();
+                descreen(&config, pow2);
+                elapsed = now()-start;
+                if (bestDescreen < 0 || elapsed < bestDescreen)
+                {
+                    bestDescreen = elapsed;
+                }
+            }
+        }
+        descreenDestroyContext(context);
+
+        if (!found)
+        {
+            printf("%-8s %14.2f %14s %10s %10s (no screentone detected)\n", names[strategy], bestAnalyze*1000, "-", "-", "-");
+            continue;
+        }
+        // The first strategy is the reference every other one is compared to
+        int maxDifference = 0;
+        if (strategy == 0)
+        {
+            memcpy(reference, work, imageSize);
+        } else
+        {
+            for (size_t sample = 0; sample < imageSize; sample++)
+            {
+                int difference = abs(work[sample]-reference[sample]);
+                if (difference > maxDifference)
+                {
+                    maxDifference = difference;
+                }
+            }
+        }
+        printf("%-8s %14.2f %14.2f %10.2f %10i (%iLPI, %ideg)\n", names[strategy], bestAnalyze*1000, bestDescreen*1000,
+               megapixels/(bestAnalyze+bestDescreen), maxDifference, config.lpi, config.angle);
+    }
+
+    free(reference);
+    free(work);
+    stbi_image_free(pixels);
+    return 0;
+}
+
+int runSynthetic(const syntheticBench *bench)
+{
+    size_t imageSize = bench->width*bench->height*bench->components;
+    double megapixels = (double)bench->width*bench->height/1e6;
+    unsigned char *pixels = malloc(imageSize),
+                  *work = malloc(imageSize);
+    if (pixels == NULL || work == NULL)
+    {
+        printf("Error allocating image buffers\n");
+        free(pixels);
+        free(work);
+        return 1;
+    }
+    generateHalftone(pixels, bench);
+
+    const char *dots[4] = {"round", "square", "line", "ellipse"};
+    printf("%zux%zu, %.2f megapixels, %i components, %i DPI, %iLPI at %ideg, %s dots, best of %i\n",
+           bench->width, bench->height, megapixels, bench->components, bench->dpi, bench->lpi, bench->angle,
+           dots[bench->dot], bench->iterations);
+    printf("%-6s %-8s %14s %14s %14s %14s %10s %10s\n", "pow2", "threads", "analyze (ms)", "analyze MP/s",
+           "descreen (ms)", "descreen MP/s", "detected", "windows");
+    int failures = 0;
+    for (int pow2 = bench->minPow2; pow2 <= bench->maxPow2; pow2++)
+    {
+        for (int count = 0; count < bench->threadCounts; count++)
+        {
+            // Plans are made before timing starts, they are reused by every iteration
+            descreenContext *context = descreenCreateContext();
+            descreenConfig config = {0};
+            config.context = context;
+            config.pixels = pixels;
+            config.width  = bench->width;
+            config.height = bench->height;
+            config.components = bench->components;
+            config.dpi     = bench->dpi;
+            config.threads = bench->threads[count];
+            config.transform = bench->transform;
+            descreenScreenMap map;
+            analyzeGrid(&config, pow2, 0, 0, &map);
+            freeScreenMap(&map);
+
+            double bestAnalyze = -1,
+                   bestDescreen = -1;
+            int found = 0;
+            for (int iteration = 0; iteration < bench->iterations; iteration++)
+            {
+                config.pixels = pixels;
+                double start = now();
+                found = analyzeGrid(&config, pow2, 0, 0, &map);
+                double elapsed = now()-start;
+                if (bestAnalyze < 0 || elapsed < bestAnalyze)
+                {
+                    bestAnalyze = elapsed;
+                }
+                // The screen map is only needed for the descreen pass of the last iteration
+                if (iteration+1 < bench->iterations || found == 0)
+                {
+                    freeScreenMap(&map);
+                }
+            }
+            // Accuracy counts the windows of the grid that found the known screen, not just the consensus
+            int matching = 0;
+            if (found)
+            {
+                for (int tile = 0; tile < map.columns*map.rows; tile++)
+                {
+                    matching += map.tiles[tile].confidence > 0 && matchesScreen(bench, pow2, map.tiles[tile].lpi, map.tiles[tile].angle);
+                }
+                config.screenMap = &map;
+                for (int iteration = 0; iteration < bench->iterations; iteration++)
+                {
+                    memcpy(work, pixels, imageSize);
+                    config.pixels = work;
+                    double start = now();
+                    descreen(&config, pow2);
+                    double elapsed = now()-start;
+                    if (bestDescreen < 0 || elapsed < bestDescreen)
+                    {
+                        bestDescreen = elapsed;
+                    }
+                }
+                config.screenMap = NULL;
+            }
+            descreenDestroyContext(context);
+
+            char detected[32],
+                 windows[32];
+            int correct = found && matchesScreen(bench, pow2, config.lpi, config.angle);
+            failures += correct == 0;
+            if (found)
+            {
+                snprintf(detected, sizeof(detected), "%i/%i%s", config.lpi, config.angle, correct ? "" : "!");
+                snprintf(windows, sizeof(windows), "%.0f%%", 100.0*matching/(map.columns*map.rows));
+                printf("%-6i %-8i %14.2f %14.2f %14.2f %14.2f %10s %10s\n", pow2, bench->threads[count],
+                       bestAnalyze*1000, megapixels/bestAnalyze, bestDescreen*1000, megapixels/bestDescreen, detected, windows);
+                freeScreenMap(&map);
+            } else
+            {
+                printf("%-6i %-8i %14.2f %14.2f %14s %14s %10s %10s\n", pow2, bench->threads[count],
+                       bestAnalyze*1000, megapixels/bestAnalyze, "-", "-", "none!", "0%");
+            }
+        }
+    }
+    // Detections are shown as LPI/angle, a ! marks one that does not match the generated screen
+    if (failures > 0)
+    {
+        printf("%i of %i runs did not detect the generated screen\n", failures, (bench->maxPow2-bench->minPow2+1)*bench->threadCounts);
+    }
+
+    free(work);
+    free(pixels);
+    return failures > 0 ? 1 : 0;
+}
+
+int verifyDetection(const syntheticBench *defaults)
+{
+    const char *dots[4] = {"round", "square", "line", "ellipse"};
+    int screens = sizeof(verifyScreens)/sizeof(verifyScreens[0]),
+        size = 1<<VERIFY_POW2,
+        failures = 0;
+    printf("%-10s %-8s %-10s %10s %10s %10s\n", "screen", "dots", "components", "analyze", "grid", "descreen");
+    for (int screen = 0; screen < screens; screen++)
+    {
+        syntheticBench bench = *defaults;
+        bench.width  = VERIFY_SIZE;
+        bench.height = VERIFY_SIZE;
+        bench.components = verifyScreens[screen].components;
+        bench.lpi   = verifyScreens[screen].lpi;
+        bench.angle = verifyScreens[screen].angle;
+        bench.dot   = verifyScreens[screen].dot;
+        size_t imageSize = bench.width*bench.height*bench.components;
+        unsigned char *pixels   = malloc(imageSize),
+                      *filtered = malloc(imageSize),
+                      *streamed = malloc(imageSize);
+        if (pixels == NULL || filtered == NULL || streamed == NULL)
+        {
+            printf("Error allocating image buffers\n");
+            free(pixels);
+            free(filtered);
+            free(streamed);
+            return 1;
+        }
+        generateHalftone(pixels, &bench);
+
+        // No call is given a context, so every one of them creates and destroys a temporary one
+        descreenConfig config = {0};
+        config.pixels = pixels;
+        config.width  = bench.width;
+        config.height = bench.height;
+        config.components = bench.components;
+        config.dpi     = bench.dpi;
+        config.threads = bench.threads[0];
+        config.transform = bench.transform;
+        descreenConfig window = config;
+        int analyzed = analyze(&window, (bench.width-size)/2, (bench.height-size)/2, VERIFY_POW2) &&
+                       matchesScreen(&bench, VERIFY_POW2, window.lpi, window.angle);
+        descreenScreenMap map;
+        int found = analyzeGrid(&config, VERIFY_POW2, 0, 0, &map) &&
+                    matchesScreen(&bench, VERIFY_POW2, config.lpi, config.angle);
+
+        // Both ways of descreening have to give the very same pixels
+        int descreened = 0;
+        if (found)
+        {
+            memcpy(filtered, pixels, imageSize);
+            config.pixels = filtered;
+            config.screenMap = &map;
+            memoryRows input = {pixels, bench.width*bench.components, 0},
+                       output = {streamed, bench.width*bench.components, 0};
+            descreened = descreen(&config, VERIFY_POW2) &&
+                         descreenStream(&config, VERIFY_POW2, readMemoryRows, &input, writeMemoryRows, &output) &&
+                         output.row == bench.height && memcmp(filtered, streamed, imageSize) == 0;
+        }
+        freeScreenMap(&map);
+
+        char detected[3][32];
+        snprintf(detected[0], sizeof(detected[0]), "%i/%i%s", window.lpi, window.angle, analyzed ? "" : "!");
+        snprintf(detected[1], sizeof(detected[1]), "%i/%i%s", config.lpi, config.angle, found ? "" : "!");
+        snprintf(detected[2], sizeof(detected[2]), "%s", descreened ? "ok" : (found ? "differs!" : "-"));
+        char expected[32];
+        snprintf(expected, sizeof(expected), "%i/%i", bench.lpi, bench.angle);
+        printf("%-10s %-8s %-10i %10s %10s %10s\n", expected, dots[bench.dot], bench.components,
+               detected[0], detected[1], detected[2]);
+        failures += analyzed == 0 || found == 0 || descreened == 0;
+        free(streamed);
+        free(filtered);
+        free(pixels);
+    }
+    // Detections are shown as LPI/angle, a ! marks one that does not match the generated screen
+    if (failures > 0)
+    {
+        printf("%i of %i halftones failed\n", failures, screens);
+    }
+    return failures > 0 ? 1 : 0;
+}
+
+int verifyLargeOffsets(const syntheticBench *defaults, const char *directory)
+{
+    syntheticBench bench = *defaults;
+    bench.width  = VERIFY_SIZE;
+    bench.height = VERIFY_SIZE;
+    bench.components = 1;
+    int size = 1<<VERIFY_POW2;
+    size_t imageSize = bench.width*bench.height;
+    unsigned char *pixels = malloc(imageSize);
+    char path[4096];
+    if (pixels == NULL || snprintf(path, sizeof(path), "%s/descreen-large-XXXXXX", directory) >= (int)sizeof(path))
+    {
+        printf("Error allocating image buffers\n");
+        free(pixels);
+        return 1;
+    }
+    generateHalftone(pixels, &bench);
+
+    // Only the rows of the view are written, everything around them stays a hole in the file
+    off_t fileSize = LARGE_OFFSET+(off_t)(LARGE_STRIDE*bench.height);
+    int file = mkstemp(path);
+    int written = file >= 0 && ftruncate(file, fileSize) == 0;
+    for (size_t row = 0; written && row < bench.height; row++)
+    {
+        written = pwrite(file, pixels+row*bench.width, bench.width, LARGE_OFFSET+(off_t)(row*LARGE_STRIDE)) == (ssize_t)bench.width;
+    }
+    if (file >= 0)
+    {
+        close(file);
+    }
+    // Rows are mapped LARGE_STRIDE bytes apart, as a raw image as wide as the stride
+    mappedImage image;
+    int mapped = written && mapRawImage(&image, path, LARGE_STRIDE, bench.height, 1, LARGE_OFFSET);
+    if (file >= 0)
+    {
+        unlink(path);
+    }
+    if (mapped == 0)
+    {
+        printf("Error mapping a sparse file of %.2f GB in %s\n", fileSize/1e9, directory);
+        free(pixels);
+        return 1;
+    }
+
+    descreenConfig config = {0};
+    config.pixels = image.pixels;
+    config.width  = bench.width;
+    config.height = bench.height;
+    config.components = 1;
+    config.stride = image.stride;
+    config.dpi     = bench.dpi;
+    config.threads = bench.threads[0];
+    config.transform = bench.transform;
+    // The bottom window ends past 2^31 bytes from the first pixel of the view
+    descreenConfig window = config;
+    int analyzed = analyze(&window, (bench.width-size)/2, bench.height-size, VERIFY_POW2) &&
+                   matchesScreen(&bench, VERIFY_POW2, window.lpi, window.angle);
+    descreenScreenMap map;
+    int found = analyzeGrid(&config, VERIFY_POW2, 0, 0, &map) &&
+                matchesScreen(&bench, VERIFY_POW2, config.lpi, config.angle);
+
+    int descreened = 0;
+    if (found)
+    {
+        descreenConfig packed = config;
+        packed.pixels = pixels;
+        packed.stride = 0;
+        packed.screenMap = &map;
+        config.screenMap = &map;
+        descreened = descreen(&config, VERIFY_POW2) && descreen(&packed, VERIFY_POW2);
+        for (size_t row = 0; descreened && row < bench.height; row++)
+        {
+            descreened = memcmp(image.pixels+row*image.stride, pixels+row*bench.width, bench.width) == 0;
+        }
+    }
+    freeScreenMap(&map);
+    unmapImage(&image);
+    free(pixels);
+
+    printf("%zux%zu view %zu bytes per row, at %.2f GB into a %.2f GB sparse file\n", bench.width, bench.height,
+           LARGE_STRIDE, LARGE_OFFSET/1e9, fileSize/1e9);
+    printf("analyze %i/%i%s, grid %i/%i%s, descreen %s\n", window.lpi, window.angle, analyzed ? "" : "!",
+           config.lpi, config.angle, found ? "" : "!", descreened ? "ok" : (found ? "differs!" : "-"));
+    return analyzed && found && descreened ? 0 : 1;
+}
+
+int readMemoryRows(void *data, unsigned char *pixels, size_t rows, ptrdiff_t stride)
+{
+    memoryRows *image = data;
+    for (size_t row = 0; row < rows; row++)
+    {
+        memcpy(pixels+row*stride, image->pixels+(image->row+row)*image->rowBytes, image->rowBytes);
+    }
+    image->row += rows;
+    return 1;
+}
+
+int writeMemoryRows(void *data, const unsigned char *pixels, size_t rows, ptrdiff_t stride)
+{
+    memoryRows *image = data;
+    for (size_t row = 0; row < rows; row++)
+    {
+        memcpy(image->pixels+(image->row+row)*image->rowBytes, pixels+row*stride, image->rowBytes);
+    }
+    image->row += rows;
+    return 1;
+}
+
+void generateHalftone(unsigned char *pixels, const syntheticBench *bench)
+{
+    // analyze() measures angles from the vertical axis, so the cells are rotated
+    // by 90-angle degrees for the generated screen to be detected at angle
+    double period = (double)bench->dpi/bench->lpi,
+           radians = (90-bench->angle)*M_PI/180;
+    double cosine = cos(radians),
+           sine   = sin(radians);
+    for (size_t y = 0; y < bench->height; y++)
+    {
+        for (size_t x = 0; x < bench->width; x++)
+        {
+            // Position within the screen cell, in [-1, 1) on both axes
+            double u = (x*cosine+y*sine)/period,
+                   v = (y*cosine-x*sine)/period;
+            u = 2*(u-floor(u))-1;
+            v = 2*(v-floor(v))-1;
+            // A smooth tone between 10% and 90% coverage, so dots of every size are present
+            double darkness = 0.5+0.4*sin(x/300.0)*cos(y/250.0);
+            unsigned char value = darkness > spotThreshold(bench->dot, u, v) ? 30 : 230;
+            memset(pixels+(y*bench->width+x)*bench->components, value, bench->components);
+        }
+    }
+}
+
+double spotThreshold(dotShape dot, double u, double v)
+{
+    // Every threshold lies in [0, 1], the share of the cell below a threshold is the coverage it gives
+    switch (dot)
+    {
+        case DOT_SQUARE:
+            return fabs(u) > fabs(v) ? fabs(u) : fabs(v);
+        case DOT_LINE:
+            return fabs(v);
+        case DOT_ELLIPSE:
+            return (u*u+v*v/0.49)/(1+1/0.49);
+        case DOT_ROUND:
+        default:
+            return (u*u+v*v)/2;
+    }
+}
+
+int matchesScreen(const syntheticBench *bench, int pow2, int lpi, int angle)
+{
+    // A window resolves frequencies dpi/size LPI apart, at the screen frequency
+    // neighbouring bins are about atan(dpi/(size*lpi)) degrees apart
+    double size = pow(2, pow2);
+    double lpiStep = bench->dpi/size,
+           angleStep = atan(bench->dpi/(size*bench->lpi))*180/M_PI;
+    // analyze() reports angles modulo 90 degrees, even for line screens that only repeat every 180
+    int difference = ((angle-bench->angle)%90+90)%90;
+    if (difference > 45)
+    {
+        difference = 90-difference;
+    }
+    return abs(lpi-bench->lpi) <= lpiStep+1 && difference <= angleStep+1;
+}
+
+int parseDot(const char *name, dotShape *dot)
+{
+    if (strcmp(name, "round") == 0)
+    {
+        *dot = DOT_ROUND;
+    } else if (strcmp(name, "square") == 0)
+    {
+        *dot = DOT_SQUARE;
+    } else if (strcmp(name, "line") == 0)
+    {
+        *dot = DOT_LINE;
+    } else if (strcmp(name, "ellipse") == 0)
+    {
+        *dot = DOT_ELLIPSE;
+    } else
+    {
+        return 0;
+    }
+    return 1;
+}
+
+int parseThreads(const char *list, syntheticBench *bench)
+{
+    bench->threadCounts = 0;
+    while (*list != '\0' && bench->threadCounts < MAX_THREAD_COUNTS)
+    {
+        char *end;
+        long threads = strtol(list, &end, 10);
+        if (end == list || threads < 1 || (*end != ',' && *end != '\0'))
+        {
+            return 0;
+        }
+        bench->threads[bench->threadCounts++] = threads;
+        list = *end == ',' ? end+1 : end;
+    }
+    return bench->threadCounts > 0 && *list == '\0';
+}
+
+double now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec+time.tv_nsec/1e9;
+}
@@ -1,211 +1,2060 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <math.h>
-#ifndef M_PI
-    #define M_PI 3.14159265358979323846
-#endif
-
-#include <fftw3.h>
-#include "descreen.h"
-
-// Generates magnitude value from a real and imaginary value
-static double genMagnitude(double real, double imag);
-// Finds peaks in magnitude by comparing all 4 pixels around it, if the specified
-// pixel is a peak, it will return a non-zero value, otherwise it will return 0
-static int isPeak(int width, int height, fftw_complex *fft, int x, int y);
-// Returns distance from (x1, y1) to (x2, y2)
-static double distanceFrom(int x1, int y1, int x2, int y2);
-// Calculates LPI
-static int calcLPI(int width, int height, int dpi, int x, int y);
-// Calculates angle
-static int calcAngle(int x, int y);
-
-int analyze(descreenConfig *config, int x, int y, int pow2)
-{
-    // TODO: This detects screentone frequencies and angle decently, but it also
-    // has false positives on non-screentoned images. This can probably be fixed by
-    // verifying that other peaks corresponding to screentone frequencies exist in the image.
-    int analyzeSize = pow(2, pow2);
-
-    // FFTW requires padding in order to perform in-place transforms of real data
-    // http://www.fftw.org/doc/Multi_002dDimensional-DFTs-of-Real-Data.html
-    int padding = (analyzeSize&1) ? 1 : 2;
-    double *dInput  = fftw_alloc_real((analyzeSize+padding)*analyzeSize);
-    // Casting double input to complex for output, this makes it easier to work with later
-    fftw_complex *cOutput = (fftw_complex *)dInput;
-    // This is an in-place transform, despite having difference input and output variables,
-    // since they are just different casts of the same address
-    fftw_plan plan = fftw_plan_dft_r2c_2d(analyzeSize, analyzeSize, dInput, cOutput, FFTW_ESTIMATE);
-
-    int channelPeaksX[3] = {0},
-        channelPeaksY[3] = {0};
-    int channelLPI[3] = {0};
-    // Processing loop
-    for (int channel = 0; channel < 3; channel++)
-    {
-        // Initializing input array
-        // Any out-of-bound pixels will be initialized as 0 (black)
-        for (int row = 0; row < analyzeSize; row++)
-        {
-            for (int column = 0; column < analyzeSize; column++)
-            {
-                int rowOffset = row+y;
-                int columnOffset = column+x;
-
-                double pixel;
-                if (rowOffset > config->height-1 || columnOffset > config->width-1)
-                {
-                    pixel = 0;
-                } else
-                {
-                    pixel = config->pixels[(rowOffset*config->width+columnOffset)*3+channel];
-                }
-                dInput[row*(analyzeSize+padding)+column] = pixel;
-            }
-        }
-        fftw_execute(plan);
-
-        int peakX = 0,
-            peakY = 0;
-        double largestPeak = 0;
-        int locateWidth  = (analyzeSize+padding)/2,
-            locateHeight = analyzeSize/2;
-        // row (y) is only looped for analyzeSize/2 because the bottom half of the FFT
-        // is mostly symmetrical, all information needed to detect screentones should exist
-        // in the top half. column (x) is looped for (analyzeSize+padding)/2 because FFTW's r2c
-        // function discards unneeded symmetrical data, the right horizontal half, in this case
-        for (int row = 0; row < locateHeight; row++)
-        {
-            for (int column = 0; column < locateWidth; column++)
-            {
-                // This first checks if the point is within 15 pixels from the center, if it is then it discards it,
-                // this is to make sure we are not getting false positives from the DC component or low frequencies,
-                // it then checks if it the pixel is a peak value, if it is, it checks if it is larger than the
-                // previous largest peak, if it is we will set it to the new largest peak
-                if (distanceFrom(0, 0, column, row) >  analyzeSize/8 &&
-                    isPeak(locateWidth, locateHeight, cOutput, row, column) &&
-                    genMagnitude(cOutput[row*locateWidth+column][0], cOutput[row*locateWidth+column][1]) > largestPeak)
-                {
-                    largestPeak = genMagnitude(cOutput[row*locateWidth+column][0], cOutput[row*locateWidth+column][1]);
-                    peakX = column;
-                    peakY = row;
-                }
-            }
-        }
-        channelPeaksX[channel] = peakX;
-        channelPeaksY[channel] = peakY;
-        channelLPI[channel] = calcLPI(analyzeSize, analyzeSize, config->dpi, peakX, peakY);
-    }
-    int peakFound = 0;
-    // Checking if the detected peaks in each channel match, if 2 or more match, we will set lpi and angle in *config
-    // to the detected values
-    // TODO: This could probably be cleaned up
-    if (channelLPI[0] == channelLPI[1] ||
-        channelLPI[0] == channelLPI[2])
-    {
-        peakFound = 1;
-        config->lpi = channelLPI[0];
-        config->angle = calcAngle(channelPeaksX[0], channelPeaksY[0]);
-    } else if (channelLPI[1] == channelLPI[2])
-    {
-        peakFound = 1;
-        config->lpi = channelLPI[1];
-        config->angle = calcAngle(channelPeaksX[1], channelPeaksY[1]);
-    }
-
-    fftw_destroy_plan(plan);
-    fftw_free(dInput);
-    return peakFound;
-}
-
-int descreen(descreenConfig *config, int pow2)
-{
-    return 0;
-}
-
-double genMagnitude(double real, double imag)
-{
-    return sqrt((real*real)+(imag*imag));
-}
-
-int isPeak(int width, int height, fftw_complex *fft, int x, int y)
-{
-    double magValue = genMagnitude(fft[y*width+x][0], fft[y*width+x][1]);
-
-    int isPeak = 1;
-    // Checks each pixel around the specified one to check if it's brighter,
-    // if it is, isPeak is set to 0 and we will break from the loop
-    // TODO: There is probably a better way to do this, but this works for now
-    for (int side = 0; side < 4; side++)
-    {
-        switch (side)
-        {
-            case 0:
-                if (y == 0)
-                {
-                    break;
-                }
-                if (magValue <= genMagnitude(fft[(y-1)*width+x][0], fft[(y-1)*width+x][1]))
-                {
-                    isPeak = 0;
-                }
-                break;
-            case 1:
-                if (x >= width-1)
-                {
-                    break;
-                }
-                if (magValue <= genMagnitude(fft[y*width+(x+1)][0], fft[y*width+(x+1)][1]))
-                {
-                    isPeak = 0;
-                }
-                break;
-            case 2:
-                if (y >= height-1)
-                {
-                    break;
-                }
-                if (magValue <= genMagnitude(fft[(y+1)*width+x][0], fft[(y+1)*width+x][1]))
-                {
-                    isPeak = 0;
-                }
-                break;
-            case 3:
-                if (x == 0)
-                {
-                    break;
-                }
-                if (magValue <= genMagnitude(fft[y*width+(x-1)][0], fft[y*width+(x-1)][1]))
-                {
-                    isPeak = 0;
-                }
-                break;
-            default:
-                // This should never happen
-                return 0;
-        }
-        if (isPeak == 0)
-        {
-            break;
-        }
-    }
-
-    return isPeak;
-}
-
-double distanceFrom(int x1, int y1, int x2, int y2)
-{
-    return sqrt(pow(x2 - x1, 2) + pow(y2 - y1, 2));
-}
-
-int calcLPI(int width, int height, int dpi, int x, int y)
-{
-    double widthInches  = (double)width/dpi,
-           heightInches = (double)height/dpi;
-    return round(distanceFrom(0, 0, round((double)x/widthInches), round((double)y/heightInches)));
-}
-
-int calcAngle(int x, int y)
-{
-    return round(fmod((atan2(x, y) * 180/M_PI), 30));
-}
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#ifndef M_PI
+    #define M_PI 3.14159265358979323846
+#endif
+
+#include <pthread.h>
+#include <fftw3.h>
+#include "descreen.h"
+#include "precision.h"
+#include "parallel.h"
+#include "peaks.h"
+
+// Peak to mean squared magnitude ratio below which a detected peak is indistinguishable from noise
+#define PROMINENCE_FLOOR 100.0
+// Luma analysis confidence below which a window is analyzed again channel by channel
+#define LUMA_FALLBACK_CONFIDENCE 0.5
+// Notch masks a context keeps for later descreens, the least recently used one is evicted beyond this
+#define MASK_CACHE_ENTRIES 8
+// Bands of step rows a descreen accumulates into at once, a tile row adds to two of them,
+// a third lets the next tile row start its overlap-adds while the band above is flushed
+#define ACCUMULATOR_BANDS 3
+// Windows held between their transforms and their overlap-add, per worker thread
+#define SLOTS_PER_THREAD 2
+
+// Spare in-place transform buffer, linked into the free list of its window size
+typedef struct descreenBuffer
+{
+    descreenReal *data;
+    struct descreenBuffer *next;
+} descreenBuffer;
+
+// Batched plans and spare buffers for a single window size, channel count and transform.
+// DESCREEN_TRANSFORM_PLANAR buffers hold one padded real plane per channel, transformed
+// by r2c/c2r plans. DESCREEN_TRANSFORM_PACKED buffers hold one complex plane per pair
+// of channels (first channel in the real part, second in the imaginary part), transformed
+// by complex plans, followed by a padded real plane for an odd last channel with its own
+// r2c/c2r plans and scratch space for unpacking the spectra of one pair during analysis.
+typedef struct descreenPlans
+{
+    int size;
+    int channels;
+    descreenTransform transform;
+    FFTW(plan) forward;
+    FFTW(plan) inverse;
+    FFTW(plan) oddForward;
+    FFTW(plan) oddInverse;
+    // Buffer length in reals
+    size_t length;
+    // First column the analysis peak search visits in each of the size/2+1 rows of a spectrum,
+    // every bin before it lies within size/8 of the DC component
+    int *rowStart;
+    descreenBuffer *spare;
+    struct descreenPlans *next;
+} descreenPlans;
+
+// Forward spectrum of one descreen window kept by analyzeTiles(), linked into the spectrum list of its context
+typedef struct descreenSpectrum
+{
+    // Image the window was taken from, a descreen() only uses spectra of the very same pixels
+    const unsigned char *pixels;
+    size_t width;
+    size_t height;
+    ptrdiff_t stride;
+    int components;
+    int channelOffset;
+    // Plans that transformed the window, data holds plans->length reals
+    descreenPlans *plans;
+    // Position of the window in the descreen grid, row*tileColumns+column
+    int tile;
+    descreenReal *data;
+    struct descreenSpectrum *next;
+} descreenSpectrum;
+
+// Notch mask cached by a context for one window size and screentone, linked into the
+// mask list of its context from the most to the least recently used
+typedef struct descreenMask
+{
+    int size;
+    int dpi;
+    int lpi;
+    int angle;
+    descreenReal *data;
+    // Jobs using the mask, an evicted mask is only freed once none is left
+    int users;
+    int evicted;
+    struct descreenMask *next;
+} descreenMask;
+
+struct descreenContext
+{
+    pthread_mutex_t lock;
+    descreenPlans *plans;
+    // FFTW planner flags used for new plans
+    unsigned planFlags;
+    // Spectra kept by analyzeTiles(), the bytes they hold and the most they may hold
+    descreenSpectrum *spectra;
+    size_t spectrumBytes;
+    size_t spectrumBudget;
+    // Notch masks built so far, at most MASK_CACHE_ENTRIES of them
+    descreenMask *masks;
+    int maskCount;
+};
+
+// The FFTW planner is not thread-safe, so every plan creation and destruction,
+// in every context, has to hold this lock
+static pthread_mutex_t plannerLock = PTHREAD_MUTEX_INITIALIZER;
+// A descreenStats may be shared by the workers of several calls, every update holds this lock
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// What a descreenSlot is being used for
+typedef enum
+{
+    SLOT_FREE,
+    SLOT_TRANSFORMING,
+    SLOT_READY,
+    SLOT_ACCUMULATING
+} descreenSlotState;
+
+// Window held from its transforms until it has been overlap-added
+typedef struct
+{
+    descreenSlotState state;
+    // Position of the window in the grid, row*tileColumns+column
+    int tile;
+    // In-place transform buffer of the slot
+    descreenReal *buffer;
+    // Where the transformed window is, the buffer or the spectrum analyzeTiles() kept for it
+    descreenReal *data;
+} descreenSlot;
+
+// State shared by every worker while descreening a single image
+typedef struct
+{
+    descreenConfig *config;
+    // Window size and the distance between neighbouring windows
+    int size;
+    int step;
+    int padding;
+    int tileColumns;
+    int tileRows;
+    int threads;
+    // Interleaved components of every pixel and how many of them are filtered
+    int components;
+    int channels;
+    // Sine window, applied before the forward and after the inverse transform,
+    // the squared window of neighbouring tiles sums to 1
+    double *window;
+    // Notch mask over the r2c output, includes the 1/size^2 inverse transform scaling,
+    // shared with every other job of the context filtering the same screentone
+    descreenMask *mask;
+    descreenContext *context;
+    descreenPlans *plans;
+    // Workers started once for the whole image
+    parallelPool *pool;
+    // SLOTS_PER_THREAD windows per worker can be between their transforms and their overlap-add
+    descreenSlot *slots;
+    int slotCount;
+    // Spectra analyzeTiles() kept for this image, one per window (NULL for the ones without),
+    // or NULL if there are none. Each is freed by the worker that filters its window.
+    descreenReal **spectra;
+    // ACCUMULATOR_BANDS bands of step rows that output is accumulated into, band b of the image
+    // in band b%ACCUMULATOR_BANDS, one value per filtered channel of every pixel
+    float *accumulator;
+    // Scheduling of the windows, guarded by lock and signalled through changed whenever a step finishes.
+    // Windows are transformed in issue order, row by row with even columns before odd ones, issued is
+    // the next one. Tile rows before lastRow are done by the current descreenRows().
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int issued;
+    int lastRow;
+    // Whether each window has been overlap-added, how many of every tile row and of the whole image have
+    unsigned char *accumulated;
+    int *rowAccumulated;
+    int accumulatedTiles;
+    // Next band to be flushed and whether a worker is flushing it
+    int nextBand;
+    int flushing;
+    // Number of rows held by config->pixels when streaming, row r of the image is stored
+    // in row r%ringRows, 0 if config->pixels holds the whole image
+    int ringRows;
+    // Unfiltered copy of the rows from bottomFirst to the last one, every row a window reflected at the
+    // bottom edge can read, since their bands may be flushed before it is filled. NULL while analyzing.
+    unsigned char *bottom;
+    size_t bottomFirst;
+} descreenJob;
+
+// Returns the plans transforming channels size x size windows at once using transform,
+// creating them if needed, or NULL on failure
+static descreenPlans *getPlans(descreenContext *context, int size, int channels, descreenTransform transform);
+// Returns the plans of *context for size, channels and transform, or NULL if it has none yet.
+// The caller must hold context->lock.
+static descreenPlans *findPlans(descreenContext *context, int size, int channels, descreenTransform transform);
+// Destroys every plan in *plans, the caller must hold plannerLock
+static void destroyPlans(descreenPlans *plans);
+// Returns where channel's samples are stored in buffer and the distance (in reals)
+// between two rows and between two columns
+static descreenReal *channelPlane(const descreenPlans *plans, descreenReal *buffer, int channel, int *rowStride, int *columnStride);
+// Runs the forward and inverse transforms for every channel in buffer
+static void forwardTransform(const descreenPlans *plans, descreenReal *buffer);
+static void inverseTransform(const descreenPlans *plans, descreenReal *buffer);
+// Returns the top half (size/2 rows of size/2+1 bins, in r2c layout) of channel's spectrum after
+// forwardTransform(), packed pairs are unpacked into scratch space when their first channel is requested,
+// so channels have to be requested in order
+static FFTW(complex) *channelSpectrum(const descreenPlans *plans, descreenReal *buffer, int channel);
+// Multiplies every channel's spectrum by mask, which covers the r2c output
+static void applyMask(const descreenPlans *plans, descreenReal *buffer, const descreenReal *mask);
+// Returns the number of FFTs forwardTransform() and inverseTransform() execute for each buffer of *plans
+static int transformCount(const descreenPlans *plans);
+// Adds the time since *clock with bytes and count to stage in *stats, then moves *clock to now
+static void lapStage(descreenStats *stats, descreenStage stage, double *clock, unsigned long long bytes, unsigned long long count);
+// Adds every counter of *from to *stats, does nothing if stats is NULL
+static void mergeStats(descreenStats *stats, const descreenStats *from);
+// Takes a spare buffer of the right size for *plans, allocating one if there is none
+static descreenReal *acquireBuffer(descreenContext *context, descreenPlans *plans);
+// Returns a buffer taken with acquireBuffer() to the spare list of *plans
+static void releaseBuffer(descreenContext *context, descreenPlans *plans, descreenReal *buffer);
+// Analyzes a single window like analyze() does, but stores the result in *tile
+// instead of *config, including a confidence value for the detected screentone
+static int analyzeWindow(descreenConfig *config, size_t x, size_t y, int pow2, descreenScreenTile *tile);
+// Analyzes a single window like analyzeWindow(), transforming either every colour channel
+// (channels = colorChannels()) or only the window's luma (channels = 1)
+static int analyzeChannels(descreenConfig *config, size_t x, size_t y, int pow2, int channels, descreenScreenTile *tile);
+// Searches the spectra forwardTransform() left in buffer for the screentone peak of each of
+// channels, sets lpi, angle and confidence in *tile to the peak they agree on, overwriting the
+// spectra with their power. Returns 0 if the channels do not agree.
+static int locateScreen(const descreenConfig *config, const descreenPlans *plans, descreenReal *buffer, int channels, descreenScreenTile *tile);
+// Analyzes a single window of a grid, index is the window's position in the map
+static void analyzeGridTile(void *arg, int index, int thread);
+// Analyzes a single window for analyzeTiles(), index is the window's position in the map
+static void analyzeTile(void *arg, int index, int thread);
+// Sets the consensus of every window of *map in *map and *config, returns 0 if no window detected a screentone
+static int findConsensus(descreenConfig *config, descreenScreenMap *map);
+// Keeps a copy of the spectrum in buffer for window tile of the image of *job in its context,
+// returns 0 if the spectrum budget has no room left for it or out of memory
+static int keepSpectrum(const descreenJob *job, int tile, const descreenReal *buffer);
+// Moves the spectra kept for the image of *job out of its context into job->spectra
+static void takeSpectra(descreenJob *job);
+// Frees the spectra kept in *context for the image at pixels, or every spectrum if pixels is NULL
+static void dropSpectra(descreenContext *context, const unsigned char *pixels);
+// Returns a non-zero value if *tile detected the screentone described by lpi and angle
+static int screenMatches(const descreenScreenTile *tile, int lpi, int angle);
+// Returns the tile of *map whose window center is closest to (x, y)
+static const descreenScreenTile *nearestScreenTile(const descreenScreenMap *map, ptrdiff_t x, ptrdiff_t y);
+// Replaces bins complex values with their squared magnitudes, in place, the returned plane
+// starts at the same address and holds one real per bin
+static descreenReal *powerSpectrum(FFTW(complex) *spectrum, int bins);
+// Returns distance from (x1, y1) to (x2, y2)
+static double distanceFrom(int x1, int y1, int x2, int y2);
+// Calculates LPI
+static int calcLPI(int width, int height, int dpi, int x, int y);
+// Calculates angle
+static int calcAngle(int x, int y);
+// Builds the notch mask for a size x size window, the mask covers the r2c output
+// (size/2+1 columns) and notches the screen lattice described by dpi, lpi and angle
+static descreenReal *buildNotchMask(int size, int dpi, int lpi, int angle);
+// Returns the cached notch mask of *context for size x size windows and the screentone of *config,
+// building it if needed, or NULL if out of memory. It has to be returned with releaseMask().
+static descreenMask *acquireMask(descreenContext *context, const descreenConfig *config, int size);
+// Returns a mask taken with acquireMask(), freeing it if it has been evicted and is no longer used
+static void releaseMask(descreenContext *context, descreenMask *mask);
+// Returns the number of interleaved components of every pixel in config->pixels
+static int pixelComponents(const descreenConfig *config);
+// Returns the number of colour channels of every pixel (1 or 3), alpha is never filtered
+static int colorChannels(const descreenConfig *config);
+// Returns a non-zero value if config->channelOffset points at a component of every pixel
+static int validChannelOffset(const descreenConfig *config);
+// Returns the address of the first colour channel of the pixel at (column, row) in config->pixels
+static unsigned char *pixelAddress(const descreenConfig *config, ptrdiff_t column, ptrdiff_t row);
+// Mirrors index into [0, length), used to extend the image past its edges
+static ptrdiff_t reflectIndex(ptrdiff_t index, ptrdiff_t length);
+// Sets up the window grid, plans and sine window of *job for *config with 2^pow2 sized windows,
+// returns 0 on failure, finishJob() has to be called either way
+static int prepareWindows(descreenJob *job, descreenConfig *config, int pow2);
+// Sets up *job for descreening *config with 2^pow2 sized windows, returns 0 on failure,
+// finishJob() has to be called either way
+static int prepareJob(descreenJob *job, descreenConfig *config, int pow2);
+// Frees everything prepareJob() allocated
+static void finishJob(descreenJob *job);
+// Filters and overlap-adds every window of the first rows tile rows not done yet, then flushes
+// every band they finish, on the workers of job->pool
+static void descreenRows(descreenJob *job, int rows);
+// Worker of descreenRows(), runs flushes, overlap-adds and transforms as they become possible
+static void descreenWorker(void *arg, int index, int thread);
+// Returns the tile of the window issued at position order, row by row with even columns before odd ones
+static int issuedTile(const descreenJob *job, int order);
+// Returns a free slot for the next window to transform, with the window set in it, or NULL if there
+// is no free slot or the window has to wait. The job must be locked.
+static descreenSlot *issueSlot(descreenJob *job);
+// Returns a transformed slot whose window can be overlap-added, or NULL if there is none. The job must be locked.
+static descreenSlot *readySlot(descreenJob *job);
+// Returns a non-zero value once every window overlapping tile, which would have added to its pixels
+// before it with one pass at a time, has been overlap-added and the band it reuses has been flushed
+static int canAccumulate(const descreenJob *job, int tile);
+// Fills, transforms, notches and inverse transforms the window of *slot
+static void transformTile(descreenJob *job, descreenSlot *slot);
+// Overlap-adds the transformed window of *slot into the accumulator
+static void accumulateTile(descreenJob *job, descreenSlot *slot);
+// Copies the window at column and row of the tile grid into buffer, de-interleaved and
+// multiplied by the sine window, reflecting the image at its edges
+static void fillTile(const descreenJob *job, descreenReal *buffer, int column, int row);
+// Returns the address of the first colour channel of the pixel at (column, row) of the image being descreened
+static unsigned char *jobPixel(const descreenJob *job, ptrdiff_t column, ptrdiff_t row);
+// Copies the rows from first to first+rows-1 that lie at or past job->bottomFirst into job->bottom
+static void keepBottomRows(descreenJob *job, size_t first, size_t rows);
+// Writes a finished band of accumulated output rows back into *pixels and clears it
+static void flushBand(descreenJob *job, int band);
+
+descreenContext *descreenCreateContext(void)
+{
+    descreenContext *context = calloc(1, sizeof(descreenContext));
+    if (context == NULL)
+    {
+        return NULL;
+    }
+    if (pthread_mutex_init(&context->lock, NULL) != 0)
+    {
+        free(context);
+        return NULL;
+    }
+    context->planFlags = FFTW_ESTIMATE;
+    return context;
+}
+
+void descreenDestroyContext(descreenContext *context)
+{
+    if (context == NULL)
+    {
+        return;
+    }
+    // Spectra refer to their plans, so they go first
+    dropSpectra(context, NULL);
+    while (context->masks != NULL)
+    {
+        descreenMask *mask = context->masks;
+        context->masks = mask->next;
+        free(mask->data);
+        free(mask);
+    }
+    descreenPlans *plans = context->plans;
+    while (plans != NULL)
+    {
+        descreenPlans *next = plans->next;
+        pthread_mutex_lock(&plannerLock);
+        destroyPlans(plans);
+        pthread_mutex_unlock(&plannerLock);
+        while (plans->spare != NULL)
+        {
+            descreenBuffer *spare = plans->spare;
+            plans->spare = spare->next;
+            FFTW(free)(spare->data);
+            free(spare);
+        }
+        free(plans->rowStart);
+        free(plans);
+        plans = next;
+    }
+    pthread_mutex_destroy(&context->lock);
+    free(context);
+}
+
+void descreenSetPlanRigor(descreenContext *context, descreenPlanRigor rigor)
+{
+    unsigned flags;
+    switch (rigor)
+    {
+        case DESCREEN_PLAN_MEASURE:
+            flags = FFTW_MEASURE;
+            break;
+        case DESCREEN_PLAN_PATIENT:
+            flags = FFTW_PATIENT;
+            break;
+        case DESCREEN_PLAN_EXHAUSTIVE:
+            flags = FFTW_EXHAUSTIVE;
+            break;
+        default:
+            flags = FFTW_ESTIMATE;
+            break;
+    }
+    pthread_mutex_lock(&context->lock);
+    context->planFlags = flags;
+    pthread_mutex_unlock(&context->lock);
+}
+
+void descreenSetSpectrumBudget(descreenContext *context, size_t bytes)
+{
+    pthread_mutex_lock(&context->lock);
+    context->spectrumBudget = bytes;
+    pthread_mutex_unlock(&context->lock);
+}
+
+int descreenLoadWisdom(const char *path)
+{
+    pthread_mutex_lock(&plannerLock);
+    int loaded = FFTW(import_wisdom_from_filename)(path);
+    pthread_mutex_unlock(&plannerLock);
+    return loaded;
+}
+
+int descreenSaveWisdom(const char *path)
+{
+    pthread_mutex_lock(&plannerLock);
+    int saved = FFTW(export_wisdom_to_filename)(path);
+    pthread_mutex_unlock(&plannerLock);
+    return saved;
+}
+
+double descreenStatsTime(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec+now.tv_nsec/1e9;
+}
+
+void descreenStatsAdd(descreenStats *stats, descreenStage stage, double seconds, unsigned long long bytes, unsigned long long count)
+{
+    if (stats == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&statsLock);
+    stats->seconds[stage] += seconds;
+    stats->bytes[stage]   += bytes;
+    stats->count[stage]   += count;
+    pthread_mutex_unlock(&statsLock);
+}
+
+const char *descreenStageName(descreenStage stage)
+{
+    static const char *names[DESCREEN_STAGES] = {"decode", "fill", "forward", "peaks", "notch", "inverse", "overlap", "encode"};
+    return stage >= 0 && stage < DESCREEN_STAGES ? names[stage] : "unknown";
+}
+
+int analyze(descreenConfig *config, size_t x, size_t y, int pow2)
+{
+    descreenScreenTile tile;
+    if (validChannelOffset(config) == 0 || analyzeWindow(config, x, y, pow2, &tile) == 0)
+    {
+        return 0;
+    }
+    config->lpi   = tile.lpi;
+    config->angle = tile.angle;
+    return 1;
+}
+
+// State shared by every worker while analyzing a grid
+typedef struct
+{
+    descreenConfig *config;
+    descreenScreenMap *map;
+    int pow2;
+} descreenGridJob;
+
+int analyzeGrid(descreenConfig *config, int pow2, int columns, int rows, descreenScreenMap *map)
+{
+    int size = pow(2, pow2);
+    if (columns <= 0)
+    {
+        columns = (config->width+size-1)/size;
+    }
+    if (rows <= 0)
+    {
+        rows = (config->height+size-1)/size;
+    }
+    map->columns = columns;
+    map->rows    = rows;
+    map->size    = size;
+    map->lpi     = 0;
+    map->angle   = 0;
+    map->confidence = 0;
+    map->tiles = NULL;
+    if (validChannelOffset(config) == 0)
+    {
+        return 0;
+    }
+    map->tiles = calloc((size_t)columns*rows, sizeof(descreenScreenTile));
+    if (map->tiles == NULL)
+    {
+        return 0;
+    }
+    // Windows are spread evenly with the first and last ones touching the image edges
+    for (int row = 0; row < rows; row++)
+    {
+        for (int column = 0; column < columns; column++)
+        {
+            descreenScreenTile *tile = &map->tiles[row*columns+column];
+            tile->x = (columns > 1 && config->width > (size_t)size) ? column*(config->width-size)/(columns-1) : 0;
+            tile->y = (rows > 1 && config->height > (size_t)size) ? row*(config->height-size)/(rows-1) : 0;
+        }
+    }
+
+    // Every window has to share one context, or each one would make its own plans
+    descreenConfig gridConfig = *config;
+    if (gridConfig.context == NULL && (gridConfig.context = descreenCreateContext()) == NULL)
+    {
+        return 0;
+    }
+    descreenGridJob job = {&gridConfig, map, pow2};
+    int analyzed = parallelFor(config->threads, columns*rows, analyzeGridTile, &job);
+    if (gridConfig.context != config->context)
+    {
+        descreenDestroyContext(gridConfig.context);
+    }
+
+    return analyzed && findConsensus(config, map);
+}
+
+// State shared by every worker while analyzing the windows of a descreen grid
+typedef struct
+{
+    descreenJob job;
+    descreenScreenMap *map;
+} descreenTilesJob;
+
+int analyzeTiles(descreenConfig *config, int pow2, descreenScreenMap *map)
+{
+    map->columns = 0;
+    map->rows    = 0;
+    map->tiles   = NULL;
+    descreenTilesJob tiles;
+    tiles.map = map;
+    // The screentone is not known yet, so there is no notch mask and no accumulator to set up
+    int prepared = prepareWindows(&tiles.job, config, pow2);
+    if (prepared)
+    {
+        // Windows in the odd columns and rows of the grid start at multiples of the window size
+        map->columns = tiles.job.tileColumns/2;
+        map->rows    = tiles.job.tileRows/2;
+        map->size    = tiles.job.size;
+        map->lpi     = 0;
+        map->angle   = 0;
+        map->confidence = 0;
+        map->tiles = calloc((size_t)map->columns*map->rows, sizeof(descreenScreenTile));
+        prepared = map->tiles != NULL;
+    }
+    int found = 0;
+    if (prepared)
+    {
+        for (int row = 0; row < map->rows; row++)
+        {
+            for (int column = 0; column < map->columns; column++)
+            {
+                map->tiles[row*map->columns+column].x = (size_t)column*tiles.job.size;
+                map->tiles[row*map->columns+column].y = (size_t)row*tiles.job.size;
+            }
+        }
+        // Spectra kept by an earlier analysis of the same pixels are replaced
+        dropSpectra(tiles.job.context, config->pixels);
+        found = parallelFor(config->threads, map->columns*map->rows, analyzeTile, &tiles) &&
+                findConsensus(config, map);
+        if (found == 0)
+        {
+            dropSpectra(tiles.job.context, config->pixels);
+        }
+    }
+    finishJob(&tiles.job);
+    return found;
+}
+
+void freeScreenMap(descreenScreenMap *map)
+{
+    free(map->tiles);
+    map->tiles = NULL;
+}
+
+void analyzeGridTile(void *arg, int index, int thread)
+{
+    (void)thread;
+    descreenGridJob *job = arg;
+    descreenScreenTile *tile = &job->map->tiles[index];
+    analyzeWindow(job->config, tile->x, tile->y, job->pow2, tile);
+}
+
+void analyzeTile(void *arg, int index, int thread)
+{
+    (void)thread;
+    descreenTilesJob *tiles = arg;
+    descreenJob *job = &tiles->job;
+    descreenConfig *config = job->config;
+    descreenScreenTile *tile = &tiles->map->tiles[index];
+    int column = index%tiles->map->columns*2+1,
+        row    = index/tiles->map->columns*2+1;
+    tile->lpi   = 0;
+    tile->angle = 0;
+    tile->confidence = 0;
+    descreenReal *buffer = acquireBuffer(job->context, job->plans);
+    if (buffer == NULL)
+    {
+        return;
+    }
+
+    descreenStats stats = {0};
+    double clock = descreenStatsTime();
+    descreenTraceBegin(config->trace, "analyze window", (long long)row*job->tileColumns+column);
+    fillTile(job, buffer, column, row);
+    lapStage(&stats, DESCREEN_STAGE_FILL, &clock, (unsigned long long)job->size*job->size*job->channels, 1);
+    descreenTraceBegin(config->trace, "forward FFT", -1);
+    forwardTransform(job->plans, buffer);
+    descreenTraceEnd(config->trace, "forward FFT");
+    lapStage(&stats, DESCREEN_STAGE_FORWARD, &clock, job->plans->length*sizeof(descreenReal), transformCount(job->plans));
+    keepSpectrum(job, row*job->tileColumns+column, buffer);
+    locateScreen(config, job->plans, buffer, job->channels, tile);
+    lapStage(&stats, DESCREEN_STAGE_PEAKS, &clock, (unsigned long long)job->channels*(job->size/2)*((job->size+job->padding)/2)*sizeof(FFTW(complex)), job->channels);
+    mergeStats(config->stats, &stats);
+    descreenTraceEnd(config->trace, "analyze window");
+    releaseBuffer(job->context, job->plans, buffer);
+}
+
+int findConsensus(descreenConfig *config, descreenScreenMap *map)
+{
+    int windows = map->columns*map->rows;
+    // The consensus is the screentone with the most confident support, counting every
+    // window that detected (almost) the same lpi and angle as support for it
+    double bestSupport = 0;
+    const descreenScreenTile *best = NULL;
+    for (int candidate = 0; candidate < windows; candidate++)
+    {
+        const descreenScreenTile *tile = &map->tiles[candidate];
+        if (tile->confidence <= 0)
+        {
+            continue;
+        }
+        double support = 0;
+        for (int other = 0; other < windows; other++)
+        {
+            if (screenMatches(&map->tiles[other], tile->lpi, tile->angle))
+            {
+                support += map->tiles[other].confidence;
+            }
+        }
+        if (support > bestSupport)
+        {
+            bestSupport = support;
+            best = tile;
+        }
+    }
+    if (best == NULL)
+    {
+        return 0;
+    }
+    map->lpi   = best->lpi;
+    map->angle = best->angle;
+    map->confidence = bestSupport/windows;
+    config->lpi   = map->lpi;
+    config->angle = map->angle;
+    return 1;
+}
+
+int analyzeWindow(descreenConfig *config, size_t x, size_t y, int pow2, descreenScreenTile *tile)
+{
+    // Grayscale windows only have their luma to analyze
+    int channels = colorChannels(config);
+    if (config->analysis != DESCREEN_ANALYSIS_LUMA || channels == 1)
+    {
+        return analyzeChannels(config, x, y, pow2, channels, tile);
+    }
+    // Monochrome screens put the same peak in every channel, so a single luma transform
+    // is enough for them, only windows it is unsure about are analyzed per channel
+    int lumaFound = analyzeChannels(config, x, y, pow2, 1, tile);
+    if (lumaFound && tile->confidence >= LUMA_FALLBACK_CONFIDENCE)
+    {
+        return 1;
+    }
+    descreenScreenTile luma = *tile;
+    int found = analyzeChannels(config, x, y, pow2, channels, tile);
+    if (lumaFound && (found == 0 || luma.confidence > tile->confidence))
+    {
+        *tile = luma;
+        return 1;
+    }
+    return found;
+}
+
+int analyzeChannels(descreenConfig *config, size_t x, size_t y, int pow2, int channels, descreenScreenTile *tile)
+{
+    tile->x = x;
+    tile->y = y;
+    tile->lpi   = 0;
+    tile->angle = 0;
+    tile->confidence = 0;
+
+    int analyzeSize = pow(2, pow2);
+
+    // FFTW requires padding in order to perform in-place transforms of real data
+    // http://www.fftw.org/doc/Multi_002dDimensional-DFTs-of-Real-Data.html
+    int padding = (analyzeSize&1) ? 1 : 2;
+    descreenContext *context = config->context;
+    if (context == NULL && (context = descreenCreateContext()) == NULL)
+    {
+        return 0;
+    }
+    // All analyzed channels are transformed at once, each in its own plane of the buffer
+    descreenPlans *plans = getPlans(context, analyzeSize, channels, config->transform);
+    descreenReal *dInput = plans != NULL ? acquireBuffer(context, plans) : NULL;
+    if (dInput == NULL)
+    {
+        if (context != config->context)
+        {
+            descreenDestroyContext(context);
+        }
+        return 0;
+    }
+    descreenReal *planes[3];
+    int rowStrides[3],
+        columnStrides[3];
+    for (int channel = 0; channel < channels; channel++)
+    {
+        planes[channel] = channelPlane(plans, dInput, channel, &rowStrides[channel], &columnStrides[channel]);
+    }
+
+    // Counted locally and added to config->stats once the window is done
+    descreenStats stats = {0};
+    double clock = descreenStatsTime();
+    descreenTraceBegin(config->trace, "analyze window", -1);
+    // Initializing input array, de-interleaving the channels into their planes,
+    // or converting them to luma (BT.601 weights) when only one channel of an RGB image is analyzed
+    // Any out-of-bound pixels will be initialized as 0 (black)
+    int luma = channels < colorChannels(config);
+    for (int row = 0; row < analyzeSize; row++)
+    {
+        for (int column = 0; column < analyzeSize; column++)
+        {
+            size_t rowOffset = row+y;
+            size_t columnOffset = column+x;
+            const unsigned char *pixel = NULL;
+            if (rowOffset < config->height && columnOffset < config->width)
+            {
+                pixel = pixelAddress(config, columnOffset, rowOffset);
+            }
+
+            if (luma)
+            {
+                planes[0][row*rowStrides[0]+column*columnStrides[0]] = pixel != NULL ? 0.299*pixel[0]+0.587*pixel[1]+0.114*pixel[2] : 0;
+                continue;
+            }
+            for (int channel = 0; channel < channels; channel++)
+            {
+                planes[channel][row*rowStrides[channel]+column*columnStrides[channel]] = pixel != NULL ? pixel[channel] : 0;
+            }
+        }
+    }
+    lapStage(&stats, DESCREEN_STAGE_FILL, &clock, (unsigned long long)analyzeSize*analyzeSize*(luma ? 3 : channels), 1);
+    // This is an in-place transform, the spectra replace the input in the buffer
+    descreenTraceBegin(config->trace, "forward FFT", -1);
+    forwardTransform(plans, dInput);
+    descreenTraceEnd(config->trace, "forward FFT");
+    lapStage(&stats, DESCREEN_STAGE_FORWARD, &clock, plans->length*sizeof(descreenReal), transformCount(plans));
+
+    int peakFound = locateScreen(config, plans, dInput, channels, tile);
+    lapStage(&stats, DESCREEN_STAGE_PEAKS, &clock, (unsigned long long)channels*(analyzeSize/2)*((analyzeSize+padding)/2)*sizeof(FFTW(complex)), channels);
+    mergeStats(config->stats, &stats);
+    descreenTraceEnd(config->trace, "analyze window");
+    releaseBuffer(context, plans, dInput);
+    if (context != config->context)
+    {
+        descreenDestroyContext(context);
+    }
+    return peakFound;
+}
+
+int locateScreen(const descreenConfig *config, const descreenPlans *plans, descreenReal *buffer, int channels, descreenScreenTile *tile)
+{
+    // TODO: This detects screentone frequencies and angle decently, but it also
+    // has false positives on non-screentoned images. This can probably be fixed by
+    // verifying that other peaks corresponding to screentone frequencies exist in the image.
+    int analyzeSize = plans->size;
+    int padding = (analyzeSize&1) ? 1 : 2;
+
+    int channelPeaksX[3] = {0},
+        channelPeaksY[3] = {0};
+    int channelLPI[3] = {0};
+    double channelProminence[3] = {0};
+    // Processing loop
+    for (int channel = 0; channel < channels; channel++)
+    {
+        FFTW(complex) *cOutput = channelSpectrum(plans, buffer, channel);
+
+        // channelSpectrum() always returns rows of (analyzeSize+padding)/2 bins
+        int locateWidth  = (analyzeSize+padding)/2,
+            locateHeight = analyzeSize/2;
+        // row (y) is only searched for analyzeSize/2 because the bottom half of the FFT
+        // is mostly symmetrical, all information needed to detect screentones should exist
+        // in the top half. column (x) is searched for (analyzeSize+padding)/2 because FFTW's r2c
+        // function discards unneeded symmetrical data, the right horizontal half, in this case
+        descreenReal *power = powerSpectrum(cOutput, locateWidth*locateHeight);
+
+        // Bins within analyzeSize/8 of the DC component are excluded, to make sure we are not
+        // getting false positives from it or from low frequencies, findPeak() also sums every
+        // searched bin, which is used to tell how much the peak stands out from the rest of the spectrum
+        peakSearch peak;
+        findPeak(power, locateWidth, locateHeight, plans->rowStart, &peak);
+        int peakX = peak.column,
+            peakY = peak.row;
+        channelPeaksX[channel] = peakX;
+        channelPeaksY[channel] = peakY;
+        channelLPI[channel] = calcLPI(analyzeSize, analyzeSize, config->dpi, peakX, peakY);
+        channelProminence[channel] = peak.sum > 0 ? peak.power/(peak.sum/peak.count) : 0;
+    }
+    int peakFound = 0;
+    // Checking if the detected peaks in each channel match, if 2 or more match (or the luma
+    // was analyzed alone), we will set lpi and angle in *tile to the detected values
+    int matched = -1;
+    for (int channel = 0; channel < channels && matched < 0; channel++)
+    {
+        for (int other = 0; other < channels; other++)
+        {
+            if (channels == 1 || (other != channel && channelLPI[other] == channelLPI[channel]))
+            {
+                matched = channel;
+                break;
+            }
+        }
+    }
+    if (matched >= 0)
+    {
+        peakFound = 1;
+        tile->lpi = channelLPI[matched];
+        tile->angle = calcAngle(channelPeaksX[matched], channelPeaksY[matched]);
+        // Confidence grows with the number of agreeing channels and with how far their peaks
+        // stand out, a prominence of PROMINENCE_FLOOR or less is what noise alone produces
+        int agreeing = 0;
+        double prominence = 0;
+        for (int channel = 0; channel < channels; channel++)
+        {
+            if (channelLPI[channel] == tile->lpi)
+            {
+                agreeing++;
+                prominence += channelProminence[channel];
+            }
+        }
+        prominence /= agreeing;
+        tile->confidence = prominence > PROMINENCE_FLOOR ? (double)agreeing/channels*(1-PROMINENCE_FLOOR/prominence) : 0;
+    }
+
+    return peakFound;
+}
+
+int descreen(descreenConfig *config, int pow2)
+{
+    descreenJob job;
+    int prepared = prepareJob(&job, config, pow2);
+    if (prepared)
+    {
+        keepBottomRows(&job, 0, config->height);
+        descreenRows(&job, job.tileRows);
+    }
+    finishJob(&job);
+    // Spectra kept for these pixels are of no use once they are descreened, or if preparing failed before taking them
+    if (config->context != NULL)
+    {
+        dropSpectra(config->context, config->pixels);
+    }
+    return prepared;
+}
+
+int descreenStream(descreenConfig *config, int pow2, descreenRowReader reader, void *readerData,
+                   descreenRowWriter writer, void *writerData)
+{
+    // Rows are read into a ring that the job addresses like an image of config->height rows,
+    // the window rows being filtered and the band waiting to be written always fit in two windows
+    descreenConfig streamConfig = *config;
+    streamConfig.stride = (ptrdiff_t)config->width*pixelComponents(config);
+    int ringRows = 2*(int)pow(2, pow2);
+    unsigned char *ring = malloc((size_t)ringRows*streamConfig.stride);
+    streamConfig.pixels = ring;
+
+    descreenJob job;
+    int prepared = ring != NULL && prepareJob(&job, &streamConfig, pow2);
+    job.ringRows = ringRows;
+    size_t read = 0;
+    for (int tileRow = 0; prepared && tileRow < job.tileRows; tileRow++)
+    {
+        // Reading every row the windows of this tile row cover, in runs that don't wrap around the ring
+        size_t needed = (size_t)(tileRow+1)*job.step;
+        if (needed > config->height)
+        {
+            needed = config->height;
+        }
+        while (prepared && read < needed)
+        {
+            size_t rows = needed-read;
+            if (rows > (size_t)ringRows-read%ringRows)
+            {
+                rows = ringRows-read%ringRows;
+            }
+            double clock = descreenStatsTime();
+            descreenTraceBegin(config->trace, "read rows", read);
+            prepared = reader(readerData, ring+(read%ringRows)*streamConfig.stride, rows, streamConfig.stride);
+            descreenTraceEnd(config->trace, "read rows");
+            descreenStatsAdd(config->stats, DESCREEN_STAGE_DECODE, descreenStatsTime()-clock, rows*streamConfig.stride, 0);
+            if (prepared)
+            {
+                keepBottomRows(&job, read, rows);
+            }
+            read += rows;
+        }
+        // Only one tile row at a time, the ring holds no more than its rows
+        if (prepared)
+        {
+            descreenRows(&job, tileRow+1);
+        }
+        // Bands start at a multiple of step rows, so they never wrap around the ring either
+        size_t first = (size_t)(tileRow-1)*job.step;
+        if (prepared && tileRow > 0 && first < config->height)
+        {
+            size_t rows = config->height-first < (size_t)job.step ? config->height-first : (size_t)job.step;
+            double clock = descreenStatsTime();
+            descreenTraceBegin(config->trace, "write rows", first);
+            prepared = writer(writerData, ring+(first%ringRows)*streamConfig.stride, rows, streamConfig.stride);
+            descreenTraceEnd(config->trace, "write rows");
+            descreenStatsAdd(config->stats, DESCREEN_STAGE_ENCODE, descreenStatsTime()-clock, rows*streamConfig.stride, 0);
+        }
+    }
+    if (prepared)
+    {
+        descreenStatsAdd(config->stats, DESCREEN_STAGE_DECODE, 0, 0, 1);
+        descreenStatsAdd(config->stats, DESCREEN_STAGE_ENCODE, 0, 0, 1);
+    }
+    if (ring != NULL)
+    {
+        finishJob(&job);
+    }
+    free(ring);
+    return prepared;
+}
+
+int prepareWindows(descreenJob *job, descreenConfig *config, int pow2)
+{
+    memset(job, 0, sizeof(descreenJob));
+    job->config  = config;
+    if (config->dpi <= 0 || config->width == 0 || config->height == 0 || validChannelOffset(config) == 0)
+    {
+        return 0;
+    }
+    job->size    = pow(2, pow2);
+    job->step    = job->size/2;
+    job->padding = (job->size&1) ? 1 : 2;
+    // Windows start half a window before the image so every pixel is covered
+    // by exactly 2x2 windows, which keeps the overlap-add weights at 1
+    job->tileColumns = (config->width+job->step-1)/job->step+1;
+    job->tileRows    = (config->height+job->step-1)/job->step+1;
+    job->threads    = parallelThreads(config->threads);
+    job->components = pixelComponents(config);
+    job->channels   = colorChannels(config);
+
+    job->context = config->context;
+    if (job->context == NULL && (job->context = descreenCreateContext()) == NULL)
+    {
+        return 0;
+    }
+    // Making plans can take seconds with a rigor above DESCREEN_PLAN_ESTIMATE and no wisdom
+    descreenTraceBegin(config->trace, "plans", job->size);
+    job->plans = getPlans(job->context, job->size, job->channels, config->transform);
+    descreenTraceEnd(config->trace, "plans");
+    job->window = malloc(sizeof(double)*job->size);
+    if (job->plans == NULL || job->window == NULL)
+    {
+        return 0;
+    }
+    for (int i = 0; i < job->size; i++)
+    {
+        job->window[i] = sin(M_PI*(i+0.5)/job->size);
+    }
+    return 1;
+}
+
+int prepareJob(descreenJob *job, descreenConfig *config, int pow2)
+{
+    if (prepareWindows(job, config, pow2) == 0 || config->lpi <= 0)
+    {
+        return 0;
+    }
+    job->mask = acquireMask(job->context, config, job->size);
+    job->accumulator = calloc((size_t)ACCUMULATOR_BANDS*job->step*config->width*job->channels, sizeof(float));
+    job->accumulated = calloc((size_t)job->tileColumns*job->tileRows, 1);
+    job->rowAccumulated = calloc(job->tileRows, sizeof(int));
+    // Windows reach at most size rows past the bottom edge, so reflected rows are never further up
+    job->bottomFirst = config->height > (size_t)job->size ? config->height-job->size : 0;
+    job->bottom = malloc((config->height-job->bottomFirst)*config->width*job->components);
+    job->pool = parallelPoolCreate(job->threads);
+    int allocated = job->mask != NULL && job->accumulator != NULL && job->accumulated != NULL &&
+                    job->rowAccumulated != NULL && job->bottom != NULL && job->pool != NULL;
+    if (allocated)
+    {
+        job->slotCount = SLOTS_PER_THREAD*parallelPoolThreads(job->pool);
+        job->slots = calloc(job->slotCount, sizeof(descreenSlot));
+        allocated = job->slots != NULL;
+    }
+    if (allocated)
+    {
+        pthread_mutex_init(&job->lock, NULL);
+        pthread_cond_init(&job->changed, NULL);
+    }
+    for (int slot = 0; allocated && slot < job->slotCount; slot++)
+    {
+        job->slots[slot].buffer = acquireBuffer(job->context, job->plans);
+        allocated = job->slots[slot].buffer != NULL;
+    }
+    if (allocated)
+    {
+        takeSpectra(job);
+    }
+    return allocated;
+}
+
+void finishJob(descreenJob *job)
+{
+    parallelPoolDestroy(job->pool);
+    if (job->slots != NULL)
+    {
+        for (int slot = 0; slot < job->slotCount; slot++)
+        {
+            if (job->slots[slot].buffer != NULL)
+            {
+                releaseBuffer(job->context, job->plans, job->slots[slot].buffer);
+            }
+        }
+        free(job->slots);
+        pthread_cond_destroy(&job->changed);
+        pthread_mutex_destroy(&job->lock);
+    }
+    for (int tile = 0; job->spectra != NULL && tile < job->tileColumns*job->tileRows; tile++)
+    {
+        if (job->spectra[tile] != NULL)
+        {
+            FFTW(free)(job->spectra[tile]);
+        }
+    }
+    free(job->spectra);
+    // The mask belongs to the context, so it has to be released before a temporary context is destroyed
+    if (job->mask != NULL)
+    {
+        releaseMask(job->context, job->mask);
+        job->mask = NULL;
+    }
+    if (job->context != NULL && job->context != job->config->context)
+    {
+        descreenDestroyContext(job->context);
+    }
+    free(job->accumulator);
+    free(job->accumulated);
+    free(job->rowAccumulated);
+    free(job->bottom);
+    free(job->window);
+}
+
+void descreenRows(descreenJob *job, int rows)
+{
+    pthread_mutex_lock(&job->lock);
+    job->lastRow = rows;
+    pthread_mutex_unlock(&job->lock);
+    parallelPoolRun(job->pool, parallelPoolThreads(job->pool), descreenWorker, job);
+}
+
+void descreenWorker(void *arg, int index, int thread)
+{
+    (void)index;
+    (void)thread;
+    descreenJob *job = arg;
+    int tiles = job->lastRow*job->tileColumns;
+    pthread_mutex_lock(&job->lock);
+    // Band b has received input from both window rows that cover it once tile rows b and b+1 are done
+    while (job->accumulatedTiles < tiles || job->nextBand < job->lastRow-1)
+    {
+        // Flushes go first since they free accumulator bands, then overlap-adds since they free slots
+        int band = job->nextBand;
+        if (job->flushing == 0 && band < job->lastRow-1 &&
+            job->rowAccumulated[band] == job->tileColumns && job->rowAccumulated[band+1] == job->tileColumns)
+        {
+            job->flushing = 1;
+            pthread_mutex_unlock(&job->lock);
+            flushBand(job, band);
+            pthread_mutex_lock(&job->lock);
+            job->flushing = 0;
+            job->nextBand++;
+            pthread_cond_broadcast(&job->changed);
+            continue;
+        }
+        descreenSlot *slot = readySlot(job);
+        if (slot != NULL)
+        {
+            slot->state = SLOT_ACCUMULATING;
+            pthread_mutex_unlock(&job->lock);
+            accumulateTile(job, slot);
+            pthread_mutex_lock(&job->lock);
+            job->accumulated[slot->tile] = 1;
+            job->rowAccumulated[slot->tile/job->tileColumns]++;
+            job->accumulatedTiles++;
+            slot->state = SLOT_FREE;
+            pthread_cond_broadcast(&job->changed);
+            continue;
+        }
+        slot = issueSlot(job);
+        if (slot != NULL)
+        {
+            pthread_mutex_unlock(&job->lock);
+            transformTile(job, slot);
+            pthread_mutex_lock(&job->lock);
+            slot->state = SLOT_READY;
+            pthread_cond_broadcast(&job->changed);
+            continue;
+        }
+        pthread_cond_wait(&job->changed, &job->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+int issuedTile(const descreenJob *job, int order)
+{
+    int row    = order/job->tileColumns,
+        column = order%job->tileColumns,
+        evens  = (job->tileColumns+1)/2;
+    return row*job->tileColumns+(column < evens ? column*2 : (column-evens)*2+1);
+}
+
+descreenSlot *issueSlot(descreenJob *job)
+{
+    if (job->issued >= job->lastRow*job->tileColumns)
+    {
+        return NULL;
+    }
+    int tile = issuedTile(job, job->issued);
+    for (int slot = 0; slot < job->slotCount; slot++)
+    {
+        if (job->slots[slot].state == SLOT_FREE)
+        {
+            job->slots[slot].state = SLOT_TRANSFORMING;
+            job->slots[slot].tile  = tile;
+            job->issued++;
+            return &job->slots[slot];
+        }
+    }
+    return NULL;
+}
+
+descreenSlot *readySlot(descreenJob *job)
+{
+    for (int slot = 0; slot < job->slotCount; slot++)
+    {
+        if (job->slots[slot].state == SLOT_READY && canAccumulate(job, job->slots[slot].tile))
+        {
+            return &job->slots[slot];
+        }
+    }
+    return NULL;
+}
+
+int canAccumulate(const descreenJob *job, int tile)
+{
+    int row    = tile/job->tileColumns,
+        column = tile%job->tileColumns;
+    // Tile row r adds to bands r-1 and r, whose part of the accumulator band r-ACCUMULATOR_BANDS used last
+    if (job->nextBand <= row-ACCUMULATOR_BANDS)
+    {
+        return 0;
+    }
+    // Every pixel is summed in the order the passes used to add to it: even columns of a row wait for
+    // the overlapping windows of the row above, odd columns for their even neighbours, which
+    // waited for the rest of the row above. That keeps the output identical whatever the schedule.
+    int odd = column&1,
+        neighbourRow = odd ? row : row-1;
+    for (int other = column-1; neighbourRow >= 0 && other <= column+1; other++)
+    {
+        if (other >= 0 && other < job->tileColumns && (odd == 0 || other != column) &&
+            job->accumulated[neighbourRow*job->tileColumns+other] == 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void transformTile(descreenJob *job, descreenSlot *slot)
+{
+    descreenConfig *config = job->config;
+    int size = job->size,
+        tile = slot->tile;
+    int column = tile%job->tileColumns,
+        row    = tile/job->tileColumns;
+    ptrdiff_t top  = (ptrdiff_t)(row-1)*job->step,
+              left = (ptrdiff_t)(column-1)*job->step;
+
+    descreenStats stats = {0};
+    double clock = descreenStatsTime();
+    descreenTraceBegin(config->trace, "tile", tile);
+    // Windows without the screentone are passed through, the synthesis window alone
+    // still blends them seamlessly with their filtered neighbours
+    int filter = 1;
+    if (config->screenMap != NULL)
+    {
+        const descreenScreenTile *nearest = nearestScreenTile(config->screenMap, left+job->step, top+job->step);
+        filter = screenMatches(nearest, config->lpi, config->angle);
+    }
+    // Windows analyzeTiles() kept the spectrum of go straight to the notch mask,
+    // a window that is passed through needs its pixels instead
+    descreenReal *spectrum = job->spectra != NULL ? job->spectra[tile] : NULL;
+    descreenReal *buffer = spectrum != NULL && filter ? spectrum : slot->buffer;
+    slot->data = buffer;
+
+    // Channels are de-interleaved into the planes of the buffer, so a single
+    // batched plan transforms all of them at once
+    if (buffer != spectrum)
+    {
+        fillTile(job, buffer, column, row);
+        lapStage(&stats, DESCREEN_STAGE_FILL, &clock, (unsigned long long)size*size*job->channels, 1);
+    }
+    if (filter)
+    {
+        unsigned long long bytes = job->plans->length*sizeof(descreenReal);
+        if (buffer != spectrum)
+        {
+            descreenTraceBegin(config->trace, "forward FFT", -1);
+            forwardTransform(job->plans, buffer);
+            descreenTraceEnd(config->trace, "forward FFT");
+            lapStage(&stats, DESCREEN_STAGE_FORWARD, &clock, bytes, transformCount(job->plans));
+        }
+        applyMask(job->plans, buffer, job->mask->data);
+        lapStage(&stats, DESCREEN_STAGE_NOTCH, &clock, bytes, 1);
+        descreenTraceBegin(config->trace, "inverse FFT", -1);
+        inverseTransform(job->plans, buffer);
+        descreenTraceEnd(config->trace, "inverse FFT");
+        lapStage(&stats, DESCREEN_STAGE_INVERSE, &clock, bytes, transformCount(job->plans));
+    }
+    mergeStats(config->stats, &stats);
+    descreenTraceEnd(config->trace, "tile");
+}
+
+void accumulateTile(descreenJob *job, descreenSlot *slot)
+{
+    descreenConfig *config = job->config;
+    int size = job->size,
+        tile = slot->tile;
+    int column = tile%job->tileColumns,
+        row    = tile/job->tileColumns;
+    // Window positions can lie before the image, so they are signed like the image size copies
+    ptrdiff_t width  = config->width,
+              height = config->height;
+    ptrdiff_t top  = (ptrdiff_t)(row-1)*job->step,
+              left = (ptrdiff_t)(column-1)*job->step;
+
+    descreenStats stats = {0};
+    double clock = descreenStatsTime();
+    descreenTraceBegin(config->trace, "overlap", tile);
+    descreenReal *planes[3];
+    int rowStrides[3],
+        columnStrides[3];
+    int channels = job->channels;
+    for (int channel = 0; channel < channels; channel++)
+    {
+        planes[channel] = channelPlane(job->plans, slot->data, channel, &rowStrides[channel], &columnStrides[channel]);
+    }
+    // Only the part of the window that lies within the image is kept
+    for (int y = 0; y < size; y++)
+    {
+        ptrdiff_t rowOffset = top+y;
+        if (rowOffset < 0 || rowOffset > height-1)
+        {
+            continue;
+        }
+        float *accumulated = job->accumulator + (size_t)((rowOffset/job->step)%ACCUMULATOR_BANDS)*job->step*config->width*channels
+                                              + (size_t)(rowOffset%job->step)*config->width*channels;
+        for (int x = 0; x < size; x++)
+        {
+            ptrdiff_t columnOffset = left+x;
+            if (columnOffset < 0 || columnOffset > width-1)
+            {
+                continue;
+            }
+            double weight = job->window[y]*job->window[x];
+            for (int channel = 0; channel < channels; channel++)
+            {
+                accumulated[columnOffset*channels+channel] += planes[channel][y*rowStrides[channel]+x*columnStrides[channel]]*weight;
+            }
+        }
+    }
+    lapStage(&stats, DESCREEN_STAGE_OVERLAP, &clock, (unsigned long long)size*size*channels*sizeof(float), 1);
+    // Every window is only filtered once, its kept spectrum is of no further use
+    if (job->spectra != NULL && job->spectra[tile] != NULL)
+    {
+        FFTW(free)(job->spectra[tile]);
+        job->spectra[tile] = NULL;
+    }
+    mergeStats(config->stats, &stats);
+    descreenTraceEnd(config->trace, "overlap");
+}
+
+void fillTile(const descreenJob *job, descreenReal *buffer, int column, int row)
+{
+    const descreenConfig *config = job->config;
+    ptrdiff_t width  = config->width,
+              height = config->height;
+    ptrdiff_t top  = (ptrdiff_t)(row-1)*job->step,
+              left = (ptrdiff_t)(column-1)*job->step;
+    descreenReal *planes[3];
+    int rowStrides[3],
+        columnStrides[3];
+    for (int channel = 0; channel < job->channels; channel++)
+    {
+        planes[channel] = channelPlane(job->plans, buffer, channel, &rowStrides[channel], &columnStrides[channel]);
+    }
+    int components = job->components;
+    for (int y = 0; y < job->size; y++)
+    {
+        ptrdiff_t rowOffset = reflectIndex(top+y, height);
+        // Rows reflected at the bottom edge may have been filtered already, they are read from the copy
+        const unsigned char *bottomRow = job->bottom != NULL && top+y >= height
+                                       ? job->bottom+(rowOffset-job->bottomFirst)*width*components+config->channelOffset : NULL;
+        for (int x = 0; x < job->size; x++)
+        {
+            ptrdiff_t columnOffset = reflectIndex(left+x, width);
+            const unsigned char *pixel = bottomRow != NULL ? bottomRow+columnOffset*components : jobPixel(job, columnOffset, rowOffset);
+            double weight = job->window[y]*job->window[x];
+            for (int channel = 0; channel < job->channels; channel++)
+            {
+                planes[channel][y*rowStrides[channel]+x*columnStrides[channel]] = pixel[channel]*weight;
+            }
+        }
+    }
+}
+
+unsigned char *jobPixel(const descreenJob *job, ptrdiff_t column, ptrdiff_t row)
+{
+    return pixelAddress(job->config, column, job->ringRows > 0 ? row%job->ringRows : row);
+}
+
+void keepBottomRows(descreenJob *job, size_t first, size_t rows)
+{
+    size_t rowBytes = job->config->width*job->components;
+    for (size_t row = first > job->bottomFirst ? first : job->bottomFirst; row < first+rows; row++)
+    {
+        memcpy(job->bottom+(row-job->bottomFirst)*rowBytes, jobPixel(job, 0, row)-job->config->channelOffset, rowBytes);
+    }
+}
+
+void flushBand(descreenJob *job, int band)
+{
+    descreenConfig *config = job->config;
+    ptrdiff_t first = (ptrdiff_t)band*job->step;
+    if (band < 0 || first > (ptrdiff_t)config->height-1)
+    {
+        return;
+    }
+    ptrdiff_t rows = config->height-first;
+    if (rows > job->step)
+    {
+        rows = job->step;
+    }
+    double clock = descreenStatsTime();
+    descreenTraceBegin(config->trace, "flush band", band);
+    // Only the colour channels are written, alpha and any other component is left as it is
+    float *accumulated = job->accumulator + (size_t)(band%ACCUMULATOR_BANDS)*job->step*config->width*job->channels;
+    for (ptrdiff_t row = 0; row < rows; row++)
+    {
+        unsigned char *pixels = jobPixel(job, 0, first+row);
+        for (size_t column = 0; column < config->width; column++)
+        {
+            for (int channel = 0; channel < job->channels; channel++)
+            {
+                double value = round(*accumulated);
+                pixels[column*job->components+channel] = value < 0 ? 0 : (value > 255 ? 255 : value);
+                *accumulated++ = 0;
+            }
+        }
+    }
+    descreenStatsAdd(config->stats, DESCREEN_STAGE_OVERLAP, descreenStatsTime()-clock, (unsigned long long)rows*config->width*job->channels, 0);
+    descreenTraceEnd(config->trace, "flush band");
+}
+
+descreenPlans *getPlans(descreenContext *context, int size, int channels, descreenTransform transform)
+{
+    // Planning can take minutes above DESCREEN_PLAN_ESTIMATE, the context is only locked around
+    // the lookup and the insertion, so jobs that already have their plans never wait for it
+    pthread_mutex_lock(&context->lock);
+    descreenPlans *plans = findPlans(context, size, channels, transform);
+    unsigned planFlags = context->planFlags;
+    pthread_mutex_unlock(&context->lock);
+    if (plans == NULL)
+    {
+        int padding = (size&1) ? 1 : 2;
+        int dimensions[2] = {size, size},
+            realEmbed[2] = {size, size+padding},
+            complexEmbed[2] = {size, (size+padding)/2};
+        int realDistance = size*(size+padding),
+            complexDistance = realDistance/2;
+        int pairs = transform == DESCREEN_TRANSFORM_PACKED ? channels/2 : 0,
+            realChannels = channels-pairs*2;
+        size_t packedLength = (size_t)pairs*size*size*2,
+               scratchLength = pairs > 0 ? (size_t)2*(size/2)*complexEmbed[1]*2 : 0,
+               length = packedLength+(size_t)realChannels*realDistance+scratchLength;
+
+        plans = calloc(1, sizeof(descreenPlans));
+        descreenBuffer *spare = calloc(1, sizeof(descreenBuffer));
+        descreenReal *buffer = FFTW(alloc_real)(length);
+        int *rowStart = malloc(sizeof(int)*(size/2+1));
+        int planned = 0;
+        if (plans != NULL && spare != NULL && buffer != NULL && rowStart != NULL)
+        {
+            // Plans are made on the first buffer, every later buffer also comes from FFTW(alloc_real)()
+            // so it shares the alignment the plans were made for, which lets them be executed on any buffer.
+            // Anything but FFTW_ESTIMATE overwrites the buffer while planning, which is fine since it is new.
+            pthread_mutex_lock(&plannerLock);
+            // Packed transforms always keep their real channel plans in oddForward and oddInverse,
+            // even for windows with a single channel and no pairs
+            FFTW(plan) *realForward = transform == DESCREEN_TRANSFORM_PACKED ? &plans->oddForward : &plans->forward,
+                      *realInverse = transform == DESCREEN_TRANSFORM_PACKED ? &plans->oddInverse : &plans->inverse;
+            if (pairs > 0)
+            {
+                FFTW(complex) *packed = (FFTW(complex) *)buffer;
+                plans->forward = FFTW(plan_many_dft)(2, dimensions, pairs,
+                                                    packed, NULL, 1, size*size,
+                                                    packed, NULL, 1, size*size,
+                                                    FFTW_FORWARD, planFlags);
+                plans->inverse = FFTW(plan_many_dft)(2, dimensions, pairs,
+                                                    packed, NULL, 1, size*size,
+                                                    packed, NULL, 1, size*size,
+                                                    FFTW_BACKWARD, planFlags);
+            }
+            if (realChannels > 0)
+            {
+                descreenReal *real = buffer+packedLength;
+                *realForward = FFTW(plan_many_dft_r2c)(2, dimensions, realChannels,
+                                                      real, realEmbed, 1, realDistance,
+                                                      (FFTW(complex) *)real, complexEmbed, 1, complexDistance,
+                                                      planFlags);
+                *realInverse = FFTW(plan_many_dft_c2r)(2, dimensions, realChannels,
+                                                      (FFTW(complex) *)real, complexEmbed, 1, complexDistance,
+                                                      real, realEmbed, 1, realDistance,
+                                                      planFlags);
+            }
+            pthread_mutex_unlock(&plannerLock);
+            planned = (pairs == 0 || (plans->forward != NULL && plans->inverse != NULL)) &&
+                      (realChannels == 0 || (*realForward != NULL && *realInverse != NULL));
+        }
+        descreenPlans *existing = NULL;
+        if (planned)
+        {
+            // Only depends on the window size, so every window analyzed with these plans shares it
+            int exclusion = size/8;
+            for (int row = 0; row <= size/2; row++)
+            {
+                rowStart[row] = 0;
+                while (rowStart[row]*rowStart[row]+row*row <= exclusion*exclusion)
+                {
+                    rowStart[row]++;
+                }
+            }
+            plans->rowStart = rowStart;
+            plans->size  = size;
+            plans->channels  = channels;
+            plans->transform = transform;
+            plans->length = length;
+            spare->data  = buffer;
+            plans->spare = spare;
+            // Another thread may have made the same plans in the meantime, the first ones are kept
+            pthread_mutex_lock(&context->lock);
+            existing = findPlans(context, size, channels, transform);
+            if (existing == NULL)
+            {
+                plans->next = context->plans;
+                context->plans = plans;
+            }
+            pthread_mutex_unlock(&context->lock);
+        }
+        if (planned == 0 || existing != NULL)
+        {
+            if (plans != NULL)
+            {
+                pthread_mutex_lock(&plannerLock);
+                destroyPlans(plans);
+                pthread_mutex_unlock(&plannerLock);
+            }
+            FFTW(free)(buffer);
+            free(rowStart);
+            free(spare);
+            free(plans);
+            plans = existing;
+        }
+    }
+    return plans;
+}
+
+descreenPlans *findPlans(descreenContext *context, int size, int channels, descreenTransform transform)
+{
+    descreenPlans *plans = context->plans;
+    while (plans != NULL && (plans->size != size || plans->channels != channels || plans->transform != transform))
+    {
+        plans = plans->next;
+    }
+    return plans;
+}
+
+void destroyPlans(descreenPlans *plans)
+{
+    FFTW(plan) all[4] = {plans->forward, plans->inverse, plans->oddForward, plans->oddInverse};
+    for (int plan = 0; plan < 4; plan++)
+    {
+        if (all[plan] != NULL)
+        {
+            FFTW(destroy_plan)(all[plan]);
+        }
+    }
+}
+
+descreenReal *channelPlane(const descreenPlans *plans, descreenReal *buffer, int channel, int *rowStride, int *columnStride)
+{
+    int size = plans->size,
+        padding = (size&1) ? 1 : 2;
+    int pairs = plans->transform == DESCREEN_TRANSFORM_PACKED ? plans->channels/2 : 0;
+    if (channel < pairs*2)
+    {
+        // Interleaved with the other channel of its pair, as the real or imaginary part
+        *rowStride = size*2;
+        *columnStride = 2;
+        return buffer+(size_t)(channel/2)*size*size*2+(channel&1);
+    }
+    *rowStride = size+padding;
+    *columnStride = 1;
+    return buffer+(size_t)pairs*size*size*2+(size_t)(channel-pairs*2)*size*(size+padding);
+}
+
+void forwardTransform(const descreenPlans *plans, descreenReal *buffer)
+{
+    if (plans->transform == DESCREEN_TRANSFORM_PACKED)
+    {
+        int pairs = plans->channels/2;
+        if (pairs > 0)
+        {
+            FFTW(execute_dft)(plans->forward, (FFTW(complex) *)buffer, (FFTW(complex) *)buffer);
+        }
+        if (plans->oddForward != NULL)
+        {
+            descreenReal *real = buffer+(size_t)pairs*plans->size*plans->size*2;
+            FFTW(execute_dft_r2c)(plans->oddForward, real, (FFTW(complex) *)real);
+        }
+        return;
+    }
+    FFTW(execute_dft_r2c)(plans->forward, buffer, (FFTW(complex) *)buffer);
+}
+
+void inverseTransform(const descreenPlans *plans, descreenReal *buffer)
+{
+    if (plans->transform == DESCREEN_TRANSFORM_PACKED)
+    {
+        int pairs = plans->channels/2;
+        if (pairs > 0)
+        {
+            FFTW(execute_dft)(plans->inverse, (FFTW(complex) *)buffer, (FFTW(complex) *)buffer);
+        }
+        if (plans->oddInverse != NULL)
+        {
+            descreenReal *real = buffer+(size_t)pairs*plans->size*plans->size*2;
+            FFTW(execute_dft_c2r)(plans->oddInverse, (FFTW(complex) *)real, real);
+        }
+        return;
+    }
+    FFTW(execute_dft_c2r)(plans->inverse, (FFTW(complex) *)buffer, buffer);
+}
+
+FFTW(complex) *channelSpectrum(const descreenPlans *plans, descreenReal *buffer, int channel)
+{
+    int size = plans->size,
+        columns = (size+((size&1) ? 1 : 2))/2;
+    int pairs = plans->transform == DESCREEN_TRANSFORM_PACKED ? plans->channels/2 : 0;
+    if (channel >= pairs*2)
+    {
+        int rowStride, columnStride;
+        return (FFTW(complex) *)channelPlane(plans, buffer, channel, &rowStride, &columnStride);
+    }
+
+    FFTW(complex) *scratch = (FFTW(complex) *)(buffer+plans->length)-2*(size/2)*columns;
+    FFTW(complex) *first  = scratch,
+                 *second = scratch+(size/2)*columns;
+    if ((channel&1) == 0)
+    {
+        // With z = a+ib, A[k] = (Z[k]+conj(Z[-k]))/2 and B[k] = (Z[k]-conj(Z[-k]))/2i
+        FFTW(complex) *packed = (FFTW(complex) *)buffer+(size_t)(channel/2)*size*size;
+        for (int row = 0; row < size/2; row++)
+        {
+            int mirrorRow = (size-row)%size;
+            for (int column = 0; column < columns; column++)
+            {
+                int mirrorColumn = (size-column)%size;
+                double real = packed[row*size+column][0],
+                       imag = packed[row*size+column][1],
+                       mirrorReal = packed[mirrorRow*size+mirrorColumn][0],
+                       mirrorImag = packed[mirrorRow*size+mirrorColumn][1];
+                first[row*columns+column][0]  = (real+mirrorReal)/2;
+                first[row*columns+column][1]  = (imag-mirrorImag)/2;
+                second[row*columns+column][0] = (imag+mirrorImag)/2;
+                second[row*columns+column][1] = (mirrorReal-real)/2;
+            }
+        }
+    }
+    return (channel&1) ? second : first;
+}
+
+void applyMask(const descreenPlans *plans, descreenReal *buffer, const descreenReal *mask)
+{
+    int size = plans->size,
+        columns = (size+((size&1) ? 1 : 2))/2;
+    int pairs = plans->transform == DESCREEN_TRANSFORM_PACKED ? plans->channels/2 : 0;
+
+    // The mask is real and symmetric, so multiplying a packed spectrum by it filters both
+    // channels of the pair without separating them, the mask only covers the r2c half,
+    // the other half of the row uses the mirrored bin
+    for (int pair = 0; pair < pairs; pair++)
+    {
+        FFTW(complex) *packed = (FFTW(complex) *)buffer+(size_t)pair*size*size;
+        for (int row = 0; row < size; row++)
+        {
+            int mirrorRow = (size-row)%size;
+            for (int column = 0; column < size; column++)
+            {
+                descreenReal weight = column < columns ? mask[row*columns+column] : mask[mirrorRow*columns+(size-column)];
+                packed[row*size+column][0] *= weight;
+                packed[row*size+column][1] *= weight;
+            }
+        }
+    }
+    for (int channel = pairs*2; channel < plans->channels; channel++)
+    {
+        int rowStride, columnStride;
+        FFTW(complex) *spectrum = (FFTW(complex) *)channelPlane(plans, buffer, channel, &rowStride, &columnStride);
+        for (int bin = 0; bin < size*columns; bin++)
+        {
+            spectrum[bin][0] *= mask[bin];
+            spectrum[bin][1] *= mask[bin];
+        }
+    }
+}
+
+int transformCount(const descreenPlans *plans)
+{
+    if (plans->transform == DESCREEN_TRANSFORM_PACKED)
+    {
+        return plans->channels/2+(plans->channels&1);
+    }
+    return plans->channels;
+}
+
+void lapStage(descreenStats *stats, descreenStage stage, double *clock, unsigned long long bytes, unsigned long long count)
+{
+    double now = descreenStatsTime();
+    stats->seconds[stage] += now-*clock;
+    stats->bytes[stage]   += bytes;
+    stats->count[stage]   += count;
+    *clock = now;
+}
+
+void mergeStats(descreenStats *stats, const descreenStats *from)
+{
+    if (stats == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&statsLock);
+    for (int stage = 0; stage < DESCREEN_STAGES; stage++)
+    {
+        stats->seconds[stage] += from->seconds[stage];
+        stats->bytes[stage]   += from->bytes[stage];
+        stats->count[stage]   += from->count[stage];
+    }
+    pthread_mutex_unlock(&statsLock);
+}
+
+descreenReal *acquireBuffer(descreenContext *context, descreenPlans *plans)
+{
+    pthread_mutex_lock(&context->lock);
+    descreenBuffer *spare = plans->spare;
+    if (spare != NULL)
+    {
+        plans->spare = spare->next;
+    }
+    pthread_mutex_unlock(&context->lock);
+
+    if (spare == NULL)
+    {
+        return FFTW(alloc_real)(plans->length);
+    }
+    descreenReal *buffer = spare->data;
+    free(spare);
+    return buffer;
+}
+
+void releaseBuffer(descreenContext *context, descreenPlans *plans, descreenReal *buffer)
+{
+    descreenBuffer *spare = malloc(sizeof(descreenBuffer));
+    if (spare == NULL)
+    {
+        FFTW(free)(buffer);
+        return;
+    }
+    spare->data = buffer;
+    pthread_mutex_lock(&context->lock);
+    spare->next  = plans->spare;
+    plans->spare = spare;
+    pthread_mutex_unlock(&context->lock);
+}
+
+int keepSpectrum(const descreenJob *job, int tile, const descreenReal *buffer)
+{
+    descreenContext *context = job->context;
+    size_t bytes = job->plans->length*sizeof(descreenReal);
+    // The bytes are reserved first, so workers keeping spectra at once never exceed the budget together
+    pthread_mutex_lock(&context->lock);
+    int room = context->spectrumBytes+bytes <= context->spectrumBudget;
+    if (room)
+    {
+        context->spectrumBytes += bytes;
+    }
+    pthread_mutex_unlock(&context->lock);
+    if (room == 0)
+    {
+        return 0;
+    }
+
+    descreenSpectrum *spectrum = malloc(sizeof(descreenSpectrum));
+    descreenReal *data = FFTW(alloc_real)(job->plans->length);
+    if (spectrum == NULL || data == NULL)
+    {
+        free(spectrum);
+        if (data != NULL)
+        {
+            FFTW(free)(data);
+        }
+        pthread_mutex_lock(&context->lock);
+        context->spectrumBytes -= bytes;
+        pthread_mutex_unlock(&context->lock);
+        return 0;
+    }
+    memcpy(data, buffer, bytes);
+    const descreenConfig *config = job->config;
+    spectrum->pixels = config->pixels;
+    spectrum->width  = config->width;
+    spectrum->height = config->height;
+    spectrum->stride = config->stride;
+    spectrum->components    = config->components;
+    spectrum->channelOffset = config->channelOffset;
+    spectrum->plans = job->plans;
+    spectrum->tile  = tile;
+    spectrum->data  = data;
+    pthread_mutex_lock(&context->lock);
+    spectrum->next = context->spectra;
+    context->spectra = spectrum;
+    pthread_mutex_unlock(&context->lock);
+    return 1;
+}
+
+void takeSpectra(descreenJob *job)
+{
+    descreenContext *context = job->context;
+    const descreenConfig *config = job->config;
+    pthread_mutex_lock(&context->lock);
+    descreenSpectrum **link = &context->spectra;
+    while (*link != NULL)
+    {
+        descreenSpectrum *spectrum = *link;
+        if (spectrum->pixels != config->pixels || spectrum->width != config->width || spectrum->height != config->height ||
+            spectrum->stride != config->stride || spectrum->components != config->components ||
+            spectrum->channelOffset != config->channelOffset || spectrum->plans != job->plans)
+        {
+            link = &spectrum->next;
+            continue;
+        }
+        // Without room to hold them the windows are simply transformed again
+        if (job->spectra == NULL && (job->spectra = calloc((size_t)job->tileColumns*job->tileRows, sizeof(descreenReal *))) == NULL)
+        {
+            break;
+        }
+        *link = spectrum->next;
+        context->spectrumBytes -= spectrum->plans->length*sizeof(descreenReal);
+        job->spectra[spectrum->tile] = spectrum->data;
+        free(spectrum);
+    }
+    pthread_mutex_unlock(&context->lock);
+}
+
+void dropSpectra(descreenContext *context, const unsigned char *pixels)
+{
+    pthread_mutex_lock(&context->lock);
+    descreenSpectrum **link = &context->spectra;
+    while (*link != NULL)
+    {
+        descreenSpectrum *spectrum = *link;
+        if (pixels != NULL && spectrum->pixels != pixels)
+        {
+            link = &spectrum->next;
+            continue;
+        }
+        *link = spectrum->next;
+        context->spectrumBytes -= spectrum->plans->length*sizeof(descreenReal);
+        FFTW(free)(spectrum->data);
+        free(spectrum);
+    }
+    pthread_mutex_unlock(&context->lock);
+}
+
+int screenMatches(const descreenScreenTile *tile, int lpi, int angle)
+{
+    // Angles wrap around at 90 degrees, so 89 and 0 are neighbours
+    int angleDifference = abs(tile->angle-angle)%90;
+    if (angleDifference > 45)
+    {
+        angleDifference = 90-angleDifference;
+    }
+    return tile->confidence > 0 && abs(tile->lpi-lpi) <= 1 && angleDifference <= 1;
+}
+
+const descreenScreenTile *nearestScreenTile(const descreenScreenMap *map, ptrdiff_t x, ptrdiff_t y)
+{
+    // The grid is regular, so the nearest column and row can be found separately
+    int nearestColumn = 0,
+        nearestRow = 0;
+    for (int column = 1; column < map->columns; column++)
+    {
+        if (llabs((long long)map->tiles[column].x+map->size/2-x) < llabs((long long)map->tiles[nearestColumn].x+map->size/2-x))
+        {
+            nearestColumn = column;
+        }
+    }
+    for (int row = 1; row < map->rows; row++)
+    {
+        if (llabs((long long)map->tiles[row*map->columns].y+map->size/2-y) < llabs((long long)map->tiles[nearestRow*map->columns].y+map->size/2-y))
+        {
+            nearestRow = row;
+        }
+    }
+    return &map->tiles[nearestRow*map->columns+nearestColumn];
+}
+
+descreenReal *powerSpectrum(FFTW(complex) *spectrum, int bins)
+{
+    // Bin i is written to the i-th real, which only overlaps bins that have already been read
+    descreenReal *power = (descreenReal *)spectrum;
+    for (int bin = 0; bin < bins; bin++)
+    {
+        double real = spectrum[bin][0],
+               imag = spectrum[bin][1];
+        power[bin] = real*real+imag*imag;
+    }
+    return power;
+}
+
+double distanceFrom(int x1, int y1, int x2, int y2)
+{
+    double dx = x2 - x1,
+           dy = y2 - y1;
+    return sqrt(dx*dx + dy*dy);
+}
+
+int calcLPI(int width, int height, int dpi, int x, int y)
+{
+    double widthInches  = (double)width/dpi,
+           heightInches = (double)height/dpi;
+    return round(distanceFrom(0, 0, round((double)x/widthInches), round((double)y/heightInches)));
+}
+
+int calcAngle(int x, int y)
+{
+    // A screen's peaks repeat every 90 degrees, so this keeps all the information
+    // needed to place them again when building the notch mask
+    return (int)round(atan2(x, y) * 180/M_PI) % 90;
+}
+
+descreenReal *buildNotchMask(int size, int dpi, int lpi, int angle)
+{
+    int columns = size/2+1;
+    descreenReal *mask = malloc(sizeof(descreenReal)*size*columns);
+    if (mask == NULL)
+    {
+        return NULL;
+    }
+    // Including the inverse transform scaling here saves a pass over every window
+    double scale = 1.0/((double)size*size);
+    for (int bin = 0; bin < size*columns; bin++)
+    {
+        mask[bin] = scale;
+    }
+
+    // The screen forms a square lattice in the frequency domain, with its fundamental at
+    // (radius, angle) and a second one rotated by 90 degrees, every other peak is a harmonic
+    // of those two. Angles follow calcAngle(), which measures from the row axis.
+    double radius  = (double)lpi*size/dpi,
+           radians = angle*M_PI/180;
+    double uColumn = radius*sin(radians), uRow = radius*cos(radians),
+           vColumn = radius*cos(radians), vRow = -radius*sin(radians);
+    // Sharp halftone dots have strong harmonics well past the Nyquist frequency of the scan,
+    // these alias back into the spectrum, so harmonics up to twice the sampling rate are notched
+    int harmonics = (int)ceil(2*size/radius)+1;
+    for (int i = -harmonics; i <= harmonics; i++)
+    {
+        for (int j = -harmonics; j <= harmonics; j++)
+        {
+            if (i == 0 && j == 0)
+            {
+                continue;
+            }
+            double peakColumn = i*uColumn+j*vColumn,
+                   peakRow    = i*uRow+j*vRow;
+            if (fabs(peakColumn) > 2*size || fabs(peakRow) > 2*size)
+            {
+                continue;
+            }
+            // The further out a harmonic is, the more any rounding of lpi and angle moves it
+            double sigma = 1.5+0.01*distanceFrom(0, 0, round(peakColumn), round(peakRow));
+            // Folding the harmonic back into [-size/2, size/2) gives its aliased position
+            peakColumn -= size*floor(peakColumn/size+0.5);
+            peakRow    -= size*floor(peakRow/size+0.5);
+            int extent = ceil(sigma*3);
+            for (int row = floor(peakRow)-extent; row <= ceil(peakRow)+extent; row++)
+            {
+                for (int column = floor(peakColumn)-extent; column <= ceil(peakColumn)+extent; column++)
+                {
+                    // Notches wrap around the edges of the full spectrum, negative frequencies are stored
+                    // in the bottom half of the rows, and only the r2c half of the columns is kept, the
+                    // other half is covered by the mirrored peak, which keeps the mask exactly symmetric
+                    int maskRow = ((row%size)+size)%size,
+                        maskColumn = ((column%size)+size)%size;
+                    if (maskColumn >= columns)
+                    {
+                        continue;
+                    }
+                    double distance = (column-peakColumn)*(column-peakColumn)+(row-peakRow)*(row-peakRow);
+                    mask[maskRow*columns+maskColumn] *= 1-exp(-distance/(2*sigma*sigma));
+                }
+            }
+        }
+    }
+    return mask;
+}
+
+descreenMask *acquireMask(descreenContext *context, const descreenConfig *config, int size)
+{
+    pthread_mutex_lock(&context->lock);
+    descreenMask **link = &context->masks;
+    while (*link != NULL && ((*link)->size != size || (*link)->dpi != config->dpi ||
+                             (*link)->lpi != config->lpi || (*link)->angle != config->angle))
+    {
+        link = &(*link)->next;
+    }
+    descreenMask *mask = *link;
+    if (mask != NULL)
+    {
+        // Moving it to the front keeps the list in most recently used order
+        *link = mask->next;
+        mask->next = context->masks;
+        context->masks = mask;
+        mask->users++;
+        pthread_mutex_unlock(&context->lock);
+        return mask;
+    }
+    pthread_mutex_unlock(&context->lock);
+
+    // Masks are built without holding the lock, so other jobs of the context keep running meanwhile
+    double clock = descreenStatsTime();
+    descreenTraceBegin(config->trace, "notch mask", size);
+    mask = malloc(sizeof(descreenMask));
+    descreenReal *data = buildNotchMask(size, config->dpi, config->lpi, config->angle);
+    descreenTraceEnd(config->trace, "notch mask");
+    if (mask == NULL || data == NULL)
+    {
+        free(mask);
+        free(data);
+        return NULL;
+    }
+    descreenStatsAdd(config->stats, DESCREEN_STAGE_NOTCH, descreenStatsTime()-clock, sizeof(descreenReal)*size*(size/2+1), 0);
+    mask->size  = size;
+    mask->dpi   = config->dpi;
+    mask->lpi   = config->lpi;
+    mask->angle = config->angle;
+    mask->data  = data;
+    mask->users = 1;
+    mask->evicted = 0;
+
+    // A job filtering the same screentone may have added it in the meantime, both masks are
+    // identical, the new one is simply not cached then
+    pthread_mutex_lock(&context->lock);
+    descreenMask *cached = context->masks;
+    while (cached != NULL && (cached->size != size || cached->dpi != config->dpi ||
+                              cached->lpi != config->lpi || cached->angle != config->angle))
+    {
+        cached = cached->next;
+    }
+    if (cached != NULL)
+    {
+        mask->evicted = 1;
+        pthread_mutex_unlock(&context->lock);
+        return mask;
+    }
+    mask->next = context->masks;
+    context->masks = mask;
+    if (++context->maskCount > MASK_CACHE_ENTRIES)
+    {
+        descreenMask **last = &context->masks;
+        while ((*last)->next != NULL)
+        {
+            last = &(*last)->next;
+        }
+        descreenMask *oldest = *last;
+        *last = NULL;
+        context->maskCount--;
+        // A mask still in use is freed by the last job releasing it
+        oldest->evicted = 1;
+        if (oldest->users == 0)
+        {
+            free(oldest->data);
+            free(oldest);
+        }
+    }
+    pthread_mutex_unlock(&context->lock);
+    return mask;
+}
+
+void releaseMask(descreenContext *context, descreenMask *mask)
+{
+    pthread_mutex_lock(&context->lock);
+    int unused = --mask->users == 0 && mask->evicted;
+    pthread_mutex_unlock(&context->lock);
+    if (unused)
+    {
+        free(mask->data);
+        free(mask);
+    }
+}
+
+int pixelComponents(const descreenConfig *config)
+{
+    // Configs made before the component count existed hold RGB
+    return config->components > 0 ? config->components : 3;
+}
+
+int colorChannels(const descreenConfig *config)
+{
+    return pixelComponents(config)-config->channelOffset <= 2 ? 1 : 3;
+}
+
+int validChannelOffset(const descreenConfig *config)
+{
+    return config->channelOffset >= 0 && config->channelOffset < pixelComponents(config);
+}
+
+unsigned char *pixelAddress(const descreenConfig *config, ptrdiff_t column, ptrdiff_t row)
+{
+    // A stride of 0 means rows are packed back to back
+    ptrdiff_t stride = config->stride != 0 ? config->stride : (ptrdiff_t)config->width*pixelComponents(config);
+    return config->pixels + row*stride + (ptrdiff_t)column*pixelComponents(config) + config->channelOffset;
+}
+
+ptrdiff_t reflectIndex(ptrdiff_t index, ptrdiff_t length)
+{
+    index %= 2*length;
+    if (index < 0)
+    {
+        index += 2*length;
+    }
+    return index < length ? index : 2*length-1-index;
+}
@@ -1,25 +1,257 @@
-#ifndef DESCREEN_H_INCLUDED
-#define DESCREEN_H_INCLUDED
-
-typedef struct
-{
-    unsigned char *pixels;
-    int width;
-    int height;
-    int dpi;
-    int lpi;
-    int angle;
-
-} descreenConfig;
-
-// analyze() will analyze a 2^pow2 sized square at (x, y) in *pixels,
-// if it detects a screentone, it will set lpi and angle in *config
-// to the detected values and will return a non-zero value.
-// If no screentone could be detected, it will return 0 and *config will be unmodified.
-int analyze(descreenConfig *config, int x, int y, int pow2);
-
-// descreen() will apply a descreen filter to *pixels using the
-// parameters provided in *config, using a 2^pow2 sized square window.
-int descreen(descreenConfig *config, int pow2);
-
-#endif // DESCREEN_H_INCLUDED
+#ifndef DESCREEN_H_INCLUDED
+#define DESCREEN_H_INCLUDED
+
+#include <stddef.h>
+
+// A descreenContext caches FFTW plans and aligned work buffers for every window size
+// it has been used with, and the notch masks of the last few screentones it filtered,
+// so they can be reused across calls and across images.
+// A context may be shared by several threads calling analyze() and descreen() at once.
+typedef struct descreenContext descreenContext;
+
+// A descreenTrace records begin and end events of the work done by every thread, such as
+// every window analyzed or descreened and every FFT, and writes them in the Chrome trace
+// event format that chrome://tracing and Perfetto open. Events are kept in memory until
+// the trace is written. A trace may be shared by several threads and calls at once.
+typedef struct descreenTrace descreenTrace;
+
+// How much effort FFTW spends picking the fastest algorithm for each new plan,
+// anything above DESCREEN_PLAN_ESTIMATE times candidate algorithms on this machine,
+// which can take seconds per window size unless matching wisdom has been loaded
+typedef enum
+{
+    DESCREEN_PLAN_ESTIMATE,
+    DESCREEN_PLAN_MEASURE,
+    DESCREEN_PLAN_PATIENT,
+    DESCREEN_PLAN_EXHAUSTIVE
+} descreenPlanRigor;
+
+// How the channels of a window are transformed. DESCREEN_TRANSFORM_PLANAR runs one
+// real-to-complex transform per channel. DESCREEN_TRANSFORM_PACKED puts two channels in the
+// real and imaginary parts of a single complex transform, so RGB needs two transforms instead of three.
+typedef enum
+{
+    DESCREEN_TRANSFORM_PLANAR,
+    DESCREEN_TRANSFORM_PACKED
+} descreenTransform;
+
+// Which channels analyze() and analyzeGrid() transform to find the screentone.
+// DESCREEN_ANALYSIS_CHANNELS transforms every channel and looks for agreeing peaks.
+// DESCREEN_ANALYSIS_LUMA transforms only the luma of each window, which is enough for
+// monochrome screens, and falls back to every channel when the luma result has low confidence.
+typedef enum
+{
+    DESCREEN_ANALYSIS_CHANNELS,
+    DESCREEN_ANALYSIS_LUMA
+} descreenAnalysis;
+
+// Steps of the work measured by descreenStats, in the order an image goes through them.
+// DESCREEN_STAGE_DECODE and DESCREEN_STAGE_ENCODE are only measured by descreenStream(),
+// callers reading and writing whole images add their own with descreenStatsAdd().
+typedef enum
+{
+    // Reading and decoding the input
+    DESCREEN_STAGE_DECODE,
+    // Copying (and windowing) pixels into transform buffers
+    DESCREEN_STAGE_FILL,
+    // Forward FFTs
+    DESCREEN_STAGE_FORWARD,
+    // Power spectra and peak searches of the analysis
+    DESCREEN_STAGE_PEAKS,
+    // Building and applying notch masks
+    DESCREEN_STAGE_NOTCH,
+    // Inverse FFTs
+    DESCREEN_STAGE_INVERSE,
+    // Overlap-adding filtered windows and writing them back to the pixels
+    DESCREEN_STAGE_OVERLAP,
+    // Encoding and writing the output
+    DESCREEN_STAGE_ENCODE,
+    DESCREEN_STAGES
+} descreenStage;
+
+// Counters of every step, summed over every thread and every call that was given them. count is
+// the number of images for decode and encode, windows for fill, notch and overlap, peak searches
+// for peaks and FFTs executed for forward and inverse, where a packed pair of channels takes one.
+typedef struct
+{
+    double seconds[DESCREEN_STAGES];
+    unsigned long long bytes[DESCREEN_STAGES];
+    unsigned long long count[DESCREEN_STAGES];
+} descreenStats;
+
+// Result of analyzing a single window of a screen map
+typedef struct
+{
+    // Top left corner of the window in pixels
+    size_t x;
+    size_t y;
+    int lpi;
+    int angle;
+    // 0 if no screentone was detected, approaching 1 for a clear screentone
+    double confidence;
+} descreenScreenTile;
+
+// Screen map of a whole image, made by analyzeGrid() or analyzeTiles()
+typedef struct
+{
+    int columns;
+    int rows;
+    // Window size in pixels
+    int size;
+    // columns*rows results, in row major order
+    descreenScreenTile *tiles;
+    // Consensus of every window, confidence is the confidence weighted
+    // share of all windows that agree with lpi and angle
+    int lpi;
+    int angle;
+    double confidence;
+} descreenScreenMap;
+
+typedef struct
+{
+    unsigned char *pixels;
+    size_t width;
+    size_t height;
+    // Interleaved 8-bit components of every pixel: 1 (gray), 2 (gray, alpha), 3 (RGB)
+    // or 4 (RGBA), 0 is treated as 3. Alpha is passed through without being filtered.
+    int components;
+    // Distance in bytes from the start of one row to the start of the next, may be negative
+    // for bottom-up buffers. 0 means rows are packed (width*components bytes apart).
+    // Together with pixels this lets a config describe a view into a larger buffer.
+    ptrdiff_t stride;
+    // Index of the first colour channel within every pixel, e.g. 1 for ARGB or XRGB,
+    // components before it and after the colour channels are passed through.
+    // It has to lie in [0, components), configs with any other offset are rejected.
+    int channelOffset;
+    int dpi;
+    int lpi;
+    int angle;
+    // Number of worker threads used by descreen(), 0 uses every online processor
+    int threads;
+    // Context used for plans and buffers, if NULL a temporary one is created for each call
+    descreenContext *context;
+    // Optional screen map from analyzeGrid() or analyzeTiles(), if set descreen() passes through any window
+    // whose nearest map tile did not detect the screentone in lpi and angle
+    descreenScreenMap *screenMap;
+    // Transform strategy used by analyze() and descreen()
+    descreenTransform transform;
+    // Channels transformed by analyze() and analyzeGrid()
+    descreenAnalysis analysis;
+    // Optional counters every call adds its work to, may be shared by calls running at once
+    descreenStats *stats;
+    // Optional trace every call records its work in
+    descreenTrace *trace;
+
+} descreenConfig;
+
+// descreenCreateContext() will create an empty context, plans and buffers are created
+// the first time a window size is used. It will return NULL on failure.
+descreenContext *descreenCreateContext(void);
+
+// descreenDestroyContext() will free every plan and buffer held by *context,
+// it must not be in use by any analyze() or descreen() call.
+void descreenDestroyContext(descreenContext *context);
+
+// descreenSetPlanRigor() will set the planner rigor used for plans *context creates
+// from now on, plans it already holds are kept. New contexts use DESCREEN_PLAN_ESTIMATE.
+void descreenSetPlanRigor(descreenContext *context, descreenPlanRigor rigor);
+
+// descreenSetSpectrumBudget() will let analyzeTiles() keep up to bytes of window spectra in
+// *context for the descreen() that follows it. New contexts have a budget of 0 and keep none.
+void descreenSetSpectrumBudget(descreenContext *context, size_t bytes);
+
+// descreenLoadWisdom() will import FFTW wisdom from the file at path, so plans
+// measured by an earlier run can be recreated without measuring them again.
+// Wisdom is shared by every context. It will return a non-zero value on success.
+int descreenLoadWisdom(const char *path);
+
+// descreenSaveWisdom() will export the wisdom gathered by every plan made so far
+// to the file at path. It will return a non-zero value on success.
+int descreenSaveWisdom(const char *path);
+
+// descreenStatsTime() will return the time in seconds on a monotonic clock,
+// for measuring the stages a caller adds with descreenStatsAdd()
+double descreenStatsTime(void);
+
+// descreenStatsAdd() will add seconds, bytes and count to stage in *stats, it may be
+// called by several threads at once and does nothing if stats is NULL
+void descreenStatsAdd(descreenStats *stats, descreenStage stage, double seconds, unsigned long long bytes, unsigned long long count);
+
+// descreenStageName() will return a short lowercase name for stage, e.g. "forward"
+const char *descreenStageName(descreenStage stage);
+
+// descreenTraceCreate() will create an empty trace, event times are relative to
+// its creation. It will return NULL on failure.
+descreenTrace *descreenTraceCreate(void);
+
+// descreenTraceBegin() will record the start of name on the calling thread in *trace, id is shown
+// as an argument of the event unless it is negative. name is stored as it is, it has to outlive
+// the trace and must not need escaping in JSON. It does nothing if trace is NULL.
+void descreenTraceBegin(descreenTrace *trace, const char *name, long long id);
+
+// descreenTraceEnd() will record the end of the last name begun on the calling thread
+// in *trace. It does nothing if trace is NULL.
+void descreenTraceEnd(descreenTrace *trace, const char *name);
+
+// descreenTraceWrite() will write every event recorded in *trace to the file at path
+// as a Chrome trace JSON object. It will return a non-zero value on success.
+int descreenTraceWrite(const descreenTrace *trace, const char *path);
+
+// descreenTraceDestroy() will free *trace and every event recorded in it
+void descreenTraceDestroy(descreenTrace *trace);
+
+// analyze() will analyze a 2^pow2 sized square at (x, y) in *pixels,
+// if it detects a screentone, it will set lpi and angle in *config
+// to the detected values and will return a non-zero value.
+// If no screentone could be detected, it will return 0 and *config will be unmodified.
+int analyze(descreenConfig *config, size_t x, size_t y, int pow2);
+
+// analyzeGrid() will analyze a grid of columns x rows 2^pow2 sized windows spread evenly
+// over *pixels, in parallel using config->threads workers, and will fill *map with the
+// result of every window and their consensus. If columns or rows is 0, enough windows are
+// used to cover the image without overlapping. If a consensus is found, it will set lpi and
+// angle in *config to it and will return a non-zero value, otherwise it will return 0 and
+// *config will be unmodified. *map must be freed with freeScreenMap() either way.
+int analyzeGrid(descreenConfig *config, int pow2, int columns, int rows, descreenScreenMap *map);
+
+// analyzeTiles() will analyze the windows descreen(config, pow2) filters that lie in its odd
+// window columns and rows, a grid of 2^pow2 windows covering the image without overlapping,
+// and fill *map like analyzeGrid() does. Each window is windowed and transformed the way
+// descreen() transforms it, with every colour channel whatever config->analysis is.
+// As many of their spectra as the spectrum budget of config->context allows are kept, so a
+// descreen() of the same, unmodified pixels with the same pow2 and transform only runs the
+// inverse transform for those windows. descreen() discards the spectra it was left, whether
+// it succeeds or not. If a consensus is found, it will set lpi and angle in *config to it
+// and will return a non-zero value, otherwise it will return 0, *config will be unmodified
+// and no spectra are kept. *map must be freed with freeScreenMap() either way.
+int analyzeTiles(descreenConfig *config, int pow2, descreenScreenMap *map);
+
+// freeScreenMap() will free the tiles allocated for *map by analyzeGrid() or analyzeTiles()
+void freeScreenMap(descreenScreenMap *map);
+
+// Row callbacks used by descreenStream(), rows are passed as rows*stride bytes laid out
+// like descreenConfig.pixels with a packed stride. They return 0 to abort the stream.
+// A reader fills *pixels with the next rows of the image,
+// a writer receives the next finished rows of the output.
+typedef int (*descreenRowReader)(void *data, unsigned char *pixels, size_t rows, ptrdiff_t stride);
+typedef int (*descreenRowWriter)(void *data, const unsigned char *pixels, size_t rows, ptrdiff_t stride);
+
+// descreen() will apply a descreen filter to *pixels using the
+// parameters provided in *config, using a 2^pow2 sized square window.
+// The image is split into windows overlapping by half their size, each window is
+// transformed, the screentone peaks at lpi and angle (and their harmonics) are notched
+// out and the inverse transforms are overlap-added back into *pixels.
+// It will return a non-zero value on success and 0 on failure, in which case
+// *pixels is unmodified.
+int descreen(descreenConfig *config, int pow2);
+
+// descreenStream() will apply the same filter as descreen(), but pulls the image from top to
+// bottom through reader and pushes finished rows, in order, to writer instead of working on
+// config->pixels. config->pixels and config->stride are ignored, rows passed to the callbacks are packed.
+// Only 2^(pow2+1) input rows, a copy of the last 2^pow2 rows and 3*2^(pow2-1) accumulated rows
+// are kept in memory at once, whatever the height of the image. config->screenMap is used like descreen() does.
+// It will return a non-zero value on success and 0 on failure or if a callback returned 0.
+int descreenStream(descreenConfig *config, int pow2, descreenRowReader reader, void *readerData,
+                   descreenRowWriter writer, void *writerData);
+
+#endif // DESCREEN_H_INCLUDED
@@ -0,0 +1,827 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "imageio.h"
+#include "parallel.h"
+
+// Size of the IDAT chunks a PNG is written in
+#define PNG_CHUNK_SIZE 65536
+// Filtered bytes deflated by a single thread at once, a block is always at least one row
+#define PNG_BLOCK_SIZE 131072
+// Largest deflate window, each block is primed with this much of the data before it
+#define PNG_WINDOW_SIZE 32768
+
+struct pngBlock
+{
+    z_stream stream;
+    int initialized;
+    // Filter candidates of the row being filtered
+    unsigned char *candidates;
+    // Deflated block and its Adler-32
+    unsigned char *output;
+    size_t capacity;
+    size_t length;
+    uLong adler;
+    int failed;
+};
+
+// Group of blocks being filtered or deflated, shared by every worker
+typedef struct
+{
+    pngImage *image;
+    int final;
+    int blocks;
+} pngGroupJob;
+
+// Reads the next unsigned number of a PNM header, skipping whitespace and comments,
+// returns 0 if there is none
+static int readHeaderNumber(FILE *file, size_t *number);
+// Writes a PNG chunk of length bytes of data with its length, type and CRC
+static int writeChunk(FILE *file, const char *type, const unsigned char *data, size_t length);
+// Stores value as 4 big endian bytes at bytes
+static void storeBigEndian(unsigned char *bytes, unsigned long value);
+// Filters rowBytes bytes of row (above is the row before it) with every PNG filter type into
+// candidates and copies the one whose sum of absolute (signed) values is the smallest, a common
+// heuristic for the best filter, to filtered, filter type byte first
+static void filterRow(const unsigned char *row, const unsigned char *above, size_t rowBytes, int bpp,
+                      unsigned char *candidates, unsigned char *filtered);
+// Filters every row of one block of the pending group
+static void filterBlock(void *arg, int index, int thread);
+// Deflates one block of the pending group into its pngBlock
+static void deflateBlock(void *arg, int index, int thread);
+// Filters and deflates every pending row in parallel and appends the blocks to the zlib stream,
+// the last block ends the stream if final is non-zero
+static int deflateGroup(pngImage *image, int final);
+// Appends length bytes of the zlib stream, writing out every full IDAT chunk
+static int appendData(pngImage *image, const unsigned char *data, size_t length);
+// Reads 4 big endian bytes from file into *value, returns 0 at the end of the file
+static int readBigEndian(FILE *file, unsigned long *value);
+// Reads more compressed data for *image from its IDAT chunks, returns 0 if there is none left
+static int readCompressed(pngDecoder *image);
+// Reverses the filter of the row in image->filtered and swaps it with image->previous
+static void unfilterRow(pngDecoder *image);
+
+int pnmOpen(pnmImage *image, const char *path)
+{
+    memset(image, 0, sizeof(pnmImage));
+    image->file = fopen(path, "rb");
+    if (image->file == NULL)
+    {
+        return 0;
+    }
+    char magic[2];
+    size_t maxValue;
+    if (fread(magic, 1, 2, image->file) != 2 || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6') ||
+        readHeaderNumber(image->file, &image->width) == 0 ||
+        readHeaderNumber(image->file, &image->height) == 0 ||
+        readHeaderNumber(image->file, &maxValue) == 0 || maxValue != 255 ||
+        image->width == 0 || image->height == 0)
+    {
+        fclose(image->file);
+        image->file = NULL;
+        return 0;
+    }
+    // A single whitespace character separates the header from the samples
+    fgetc(image->file);
+    image->components = magic[1] == '5' ? 1 : 3;
+    image->data = ftello(image->file);
+    return 1;
+}
+
+int pnmCreate(pnmImage *image, const char *path, size_t width, size_t height, int components)
+{
+    memset(image, 0, sizeof(pnmImage));
+    if (components != 1 && components != 3)
+    {
+        return 0;
+    }
+    image->file = fopen(path, "wb");
+    if (image->file == NULL)
+    {
+        return 0;
+    }
+    image->width  = width;
+    image->height = height;
+    image->components = components;
+    if (fprintf(image->file, "P%c\n%zu %zu\n255\n", components == 1 ? '5' : '6', width, height) < 0)
+    {
+        fclose(image->file);
+        image->file = NULL;
+        return 0;
+    }
+    image->data = ftello(image->file);
+    return 1;
+}
+
+int pnmSeekRow(pnmImage *image, size_t row)
+{
+    return fseeko(image->file, image->data+(off_t)(row*image->width*image->components), SEEK_SET) == 0;
+}
+
+int pnmReadRows(void *image, unsigned char *pixels, size_t rows, ptrdiff_t stride)
+{
+    pnmImage *pnm = image;
+    size_t rowBytes = pnm->width*pnm->components;
+    for (size_t row = 0; row < rows; row++)
+    {
+        if (fread(pixels+(ptrdiff_t)row*stride, 1, rowBytes, pnm->file) != rowBytes)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int pnmWriteRows(void *image, const unsigned char *pixels, size_t rows, ptrdiff_t stride)
+{
+    pnmImage *pnm = image;
+    size_t rowBytes = pnm->width*pnm->components;
+    for (size_t row = 0; row < rows; row++)
+    {
+        if (fwrite(pixels+(ptrdiff_t)row*stride, 1, rowBytes, pnm->file) != rowBytes)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int pnmClose(pnmImage *image)
+{
+    if (image->file == NULL)
+    {
+        return 1;
+    }
+    int closed = fclose(image->file) == 0;
+    image->file = NULL;
+    return closed;
+}
+
+int pngDecoderOpen(pngDecoder *image, const char *path)
+{
+    memset(image, 0, sizeof(pngDecoder));
+    image->file = fopen(path, "rb");
+    if (image->file == NULL)
+    {
+        return 0;
+    }
+    static const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+    unsigned char bytes[13];
+    unsigned long length, width, height;
+    if (fread(bytes, 1, 8, image->file) != 8 || memcmp(bytes, signature, 8) != 0 ||
+        readBigEndian(image->file, &length) == 0 || length != 13 || fread(bytes, 1, 4, image->file) != 4 ||
+        memcmp(bytes, "IHDR", 4) != 0 || readBigEndian(image->file, &width) == 0 ||
+        readBigEndian(image->file, &height) == 0 || fread(bytes, 1, 9, image->file) != 9)
+    {
+        return 0;
+    }
+    // 8-bit samples (bytes[0]), deflate (bytes[2]) with adaptive filtering (bytes[3]),
+    // no interlacing (bytes[4]), colour types 0, 2, 4 and 6
+    static const int colorComponents[7] = {1, 0, 3, 0, 2, 0, 4};
+    if (bytes[0] != 8 || bytes[2] != 0 || bytes[3] != 0 || bytes[4] != 0 || bytes[1] > 6 ||
+        colorComponents[bytes[1]] == 0 || width == 0 || height == 0)
+    {
+        return 0;
+    }
+    image->width  = width;
+    image->height = height;
+    image->components = colorComponents[bytes[1]];
+    size_t rowBytes = image->width*image->components;
+    image->input = malloc(PNG_CHUNK_SIZE);
+    image->filtered = malloc(rowBytes+1);
+    image->previous = calloc(rowBytes+1, 1);
+    if (image->input == NULL || image->filtered == NULL || image->previous == NULL || inflateInit(&image->stream) != Z_OK)
+    {
+        return 0;
+    }
+    image->inflating = 1;
+    return 1;
+}
+
+int pngDecoderReadRows(void *image, unsigned char *pixels, size_t rows, ptrdiff_t stride)
+{
+    pngDecoder *png = image;
+    size_t rowBytes = png->width*png->components;
+    if (png->inflating == 0 || png->rowsRead+rows > png->height)
+    {
+        return 0;
+    }
+    for (size_t row = 0; row < rows; row++)
+    {
+        png->stream.next_out  = png->filtered;
+        png->stream.avail_out = rowBytes+1;
+        while (png->stream.avail_out > 0)
+        {
+            if (png->stream.avail_in == 0 && readCompressed(png) == 0)
+            {
+                return 0;
+            }
+            int status = inflate(&png->stream, Z_NO_FLUSH);
+            if (status != Z_OK && !(status == Z_STREAM_END && png->stream.avail_out == 0))
+            {
+                return 0;
+            }
+        }
+        // Skipped rows still have to be unfiltered, the next row may depend on them
+        if (png->filtered[0] > 4)
+        {
+            return 0;
+        }
+        unfilterRow(png);
+        if (pixels != NULL)
+        {
+            memcpy(pixels+(ptrdiff_t)row*stride, png->previous+1, rowBytes);
+        }
+        png->rowsRead++;
+    }
+    return 1;
+}
+
+void pngDecoderClose(pngDecoder *image)
+{
+    if (image->inflating)
+    {
+        inflateEnd(&image->stream);
+    }
+    if (image->file != NULL)
+    {
+        fclose(image->file);
+    }
+    free(image->input);
+    free(image->filtered);
+    free(image->previous);
+    memset(image, 0, sizeof(pngDecoder));
+}
+
+int mapImage(mappedImage *image, const char *path)
+{
+    pnmImage pnm;
+    if (pnmOpen(&pnm, path) == 0)
+    {
+        memset(image, 0, sizeof(mappedImage));
+        return 0;
+    }
+    pnmClose(&pnm);
+    return mapRawImage(image, path, pnm.width, pnm.height, pnm.components, pnm.data);
+}
+
+int mapRawImage(mappedImage *image, const char *path, size_t width, size_t height, int components, off_t offset)
+{
+    memset(image, 0, sizeof(mappedImage));
+    if (width == 0 || height == 0 || components < 1 || components > 4 || offset < 0)
+    {
+        return 0;
+    }
+    int file = open(path, O_RDONLY);
+    if (file < 0)
+    {
+        return 0;
+    }
+    struct stat status;
+    size_t stride = width*components;
+    if (fstat(file, &status) != 0 || (size_t)status.st_size < (size_t)offset+stride*height)
+    {
+        close(file);
+        return 0;
+    }
+    // A private writable mapping lets the image be descreened in place, pages are only
+    // copied once they are written and the file itself is never modified. Only the pages
+    // holding the image are mapped, however far into the file it starts.
+    off_t first = offset-offset%sysconf(_SC_PAGESIZE);
+    image->length  = (size_t)(offset-first)+stride*height;
+    image->mapping = mmap(NULL, image->length, PROT_READ|PROT_WRITE, MAP_PRIVATE, file, first);
+    close(file);
+    if (image->mapping == MAP_FAILED)
+    {
+        memset(image, 0, sizeof(mappedImage));
+        return 0;
+    }
+    image->pixels = (unsigned char *)image->mapping+(offset-first);
+    image->width  = width;
+    image->height = height;
+    image->components = components;
+    image->stride = stride;
+    return 1;
+}
+
+int detachImage(mappedImage *image)
+{
+    void *copy = mmap(NULL, image->length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (copy == MAP_FAILED)
+    {
+        return 0;
+    }
+    memcpy(copy, image->mapping, image->length);
+    munmap(image->mapping, image->length);
+    image->pixels  = (unsigned char *)copy+(image->pixels-(unsigned char *)image->mapping);
+    image->mapping = copy;
+    return 1;
+}
+
+int sameFile(const char *path, const char *other)
+{
+    struct stat pathStatus, otherStatus;
+    return stat(path, &pathStatus) == 0 && stat(other, &otherStatus) == 0 &&
+           pathStatus.st_dev == otherStatus.st_dev && pathStatus.st_ino == otherStatus.st_ino;
+}
+
+void unmapImage(mappedImage *image)
+{
+    if (image->mapping != NULL)
+    {
+        munmap(image->mapping, image->length);
+    }
+    memset(image, 0, sizeof(mappedImage));
+}
+
+int pngCreate(pngImage *image, const char *path, size_t width, size_t height, int components, int level, int threads)
+{
+    memset(image, 0, sizeof(pngImage));
+    if (components < 1 || components > 4 || width == 0 || height == 0 || width > 0x7fffffff || height > 0x7fffffff)
+    {
+        return 0;
+    }
+    image->width  = width;
+    image->height = height;
+    image->components = components;
+    image->level   = level;
+    image->threads = parallelThreads(threads);
+    image->adler   = adler32(0, NULL, 0);
+    size_t rowBytes = width*components;
+    image->blockRows = PNG_BLOCK_SIZE/(rowBytes+1) > 0 ? PNG_BLOCK_SIZE/(rowBytes+1) : 1;
+    size_t groupRows = image->blockRows*image->threads;
+    image->rows = malloc(groupRows*rowBytes);
+    image->filtered = malloc(groupRows*(rowBytes+1));
+    image->previous = calloc(rowBytes, 1);
+    image->dictionary = malloc(PNG_WINDOW_SIZE);
+    image->blocks = calloc(image->threads, sizeof(struct pngBlock));
+    image->chunk = malloc(PNG_CHUNK_SIZE);
+    image->pool = parallelPoolCreate(image->threads);
+    if (image->rows == NULL || image->filtered == NULL || image->previous == NULL ||
+        image->dictionary == NULL || image->blocks == NULL || image->chunk == NULL || image->pool == NULL)
+    {
+        return 0;
+    }
+    for (int block = 0; block < image->threads; block++)
+    {
+        struct pngBlock *pngBlock = &image->blocks[block];
+        // Raw deflate streams, the zlib header and checksum are written for the whole image
+        if (deflateInit2(&pngBlock->stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            return 0;
+        }
+        pngBlock->initialized = 1;
+        pngBlock->candidates = malloc((rowBytes+1)*5);
+        pngBlock->capacity = deflateBound(&pngBlock->stream, image->blockRows*(rowBytes+1))+64;
+        pngBlock->output = malloc(pngBlock->capacity);
+        if (pngBlock->candidates == NULL || pngBlock->output == NULL)
+        {
+            return 0;
+        }
+    }
+    image->file = fopen(path, "wb");
+    if (image->file == NULL)
+    {
+        return 0;
+    }
+
+    // Colour types 0 (gray), 4 (gray, alpha), 2 (RGB) and 6 (RGBA) with 8-bit samples
+    static const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'},
+                               colorTypes[4] = {0, 4, 2, 6};
+    unsigned char header[13] = {0};
+    storeBigEndian(header, width);
+    storeBigEndian(header+4, height);
+    header[8] = 8;
+    header[9] = colorTypes[components-1];
+    // zlib header for a 32 KiB window, FLEVEL only tells decoders roughly how hard the encoder tried
+    int effort = level < 0 ? 2 : (level < 2 ? 0 : (level < 6 ? 1 : (level == 6 ? 2 : 3)));
+    unsigned char zlibHeader[2] = {0x78, effort << 6};
+    zlibHeader[1] += (31-(zlibHeader[0]*256+zlibHeader[1])%31)%31;
+    return fwrite(signature, 1, 8, image->file) == 8 && writeChunk(image->file, "IHDR", header, 13) &&
+           appendData(image, zlibHeader, 2);
+}
+
+int pngWriteRows(void *image, const unsigned char *pixels, size_t rows, ptrdiff_t stride)
+{
+    pngImage *png = image;
+    size_t rowBytes = png->width*png->components;
+    if (png->file == NULL || png->rowsWritten+rows > png->height)
+    {
+        return 0;
+    }
+    for (size_t row = 0; row < rows; row++)
+    {
+        // A full group is only deflated once another row arrives, so the last group,
+        // which has to end the stream, is always deflated by pngClose()
+        if (png->pendingRows == png->blockRows*png->threads && deflateGroup(png, 0) == 0)
+        {
+            return 0;
+        }
+        memcpy(png->rows+png->pendingRows*rowBytes, pixels+(ptrdiff_t)row*stride, rowBytes);
+        png->pendingRows++;
+        png->rowsWritten++;
+    }
+    return 1;
+}
+
+int pngClose(pngImage *image)
+{
+    int finished = image->file != NULL && image->rowsWritten == image->height && deflateGroup(image, 1);
+    if (finished)
+    {
+        unsigned char adler[4];
+        storeBigEndian(adler, image->adler);
+        finished = appendData(image, adler, 4) &&
+                   (image->chunkLength == 0 || writeChunk(image->file, "IDAT", image->chunk, image->chunkLength)) &&
+                   writeChunk(image->file, "IEND", NULL, 0);
+    }
+    if (image->file != NULL && fclose(image->file) != 0)
+    {
+        finished = 0;
+    }
+    for (int block = 0; image->blocks != NULL && block < image->threads; block++)
+    {
+        if (image->blocks[block].initialized)
+        {
+            deflateEnd(&image->blocks[block].stream);
+        }
+        free(image->blocks[block].candidates);
+        free(image->blocks[block].output);
+    }
+    free(image->blocks);
+    parallelPoolDestroy(image->pool);
+    free(image->rows);
+    free(image->filtered);
+    free(image->previous);
+    free(image->dictionary);
+    free(image->chunk);
+    memset(image, 0, sizeof(pngImage));
+    return finished;
+}
+
+imageFormat imageFormatFromPath(const char *path)
+{
+    const char *extension = strrchr(path, '.');
+    if (extension != NULL && (strcmp(extension, ".ppm") == 0 || strcmp(extension, ".pgm") == 0 ||
+                              strcmp(extension, ".pnm") == 0))
+    {
+        return IMAGE_FORMAT_PNM;
+    }
+    return IMAGE_FORMAT_PNG;
+}
+
+int imageSinkCreate(imageSink *sink, const char *path, size_t width, size_t height, int components, int level, int threads)
+{
+    memset(sink, 0, sizeof(imageSink));
+    sink->format = imageFormatFromPath(path);
+    if (sink->format == IMAGE_FORMAT_PNM)
+    {
+        return pnmCreate(&sink->pnm, path, width, height, components);
+    }
+    return pngCreate(&sink->png, path, width, height, components, level, threads);
+}
+
+int imageSinkWriteRows(void *sink, const unsigned char *pixels, size_t rows, ptrdiff_t stride)
+{
+    imageSink *output = sink;
+    if (output->format == IMAGE_FORMAT_PNM)
+    {
+        return pnmWriteRows(&output->pnm, pixels, rows, stride);
+    }
+    return pngWriteRows(&output->png, pixels, rows, stride);
+}
+
+int imageSinkClose(imageSink *sink)
+{
+    if (sink->format == IMAGE_FORMAT_PNM)
+    {
+        return pnmClose(&sink->pnm);
+    }
+    return pngClose(&sink->png);
+}
+
+int writeChunk(FILE *file, const char *type, const unsigned char *data, size_t length)
+{
+    unsigned char bytes[8];
+    storeBigEndian(bytes, length);
+    memcpy(bytes+4, type, 4);
+    uLong crc = crc32(0, bytes+4, 4);
+    if (length > 0)
+    {
+        crc = crc32(crc, data, length);
+    }
+    if (fwrite(bytes, 1, 8, file) != 8 || (length > 0 && fwrite(data, 1, length, file) != length))
+    {
+        return 0;
+    }
+    storeBigEndian(bytes, crc);
+    return fwrite(bytes, 1, 4, file) == 4;
+}
+
+void storeBigEndian(unsigned char *bytes, unsigned long value)
+{
+    bytes[0] = (value >> 24)&0xff;
+    bytes[1] = (value >> 16)&0xff;
+    bytes[2] = (value >> 8)&0xff;
+    bytes[3] = value&0xff;
+}
+
+void filterRow(const unsigned char *row, const unsigned char *above, size_t rowBytes, int bpp,
+               unsigned char *candidates, unsigned char *filtered)
+{
+    const unsigned char *best = NULL;
+    unsigned long bestSum = 0;
+    for (int type = 0; type < 5; type++)
+    {
+        unsigned char *candidate = candidates+type*(rowBytes+1);
+        candidate[0] = type;
+        unsigned long sum = 0;
+        for (size_t i = 0; i < rowBytes; i++)
+        {
+            // a is the byte to the left, b the one above and c the one above a
+            int a = i >= (size_t)bpp ? row[i-bpp] : 0,
+                b = above[i],
+                c = i >= (size_t)bpp ? above[i-bpp] : 0;
+            int predictor = 0;
+            switch (type)
+            {
+                case 1:
+                    predictor = a;
+                    break;
+                case 2:
+                    predictor = b;
+                    break;
+                case 3:
+                    predictor = (a+b)/2;
+                    break;
+                case 4:
+                {
+                    int p = a+b-c,
+                        pa = abs(p-a),
+                        pb = abs(p-b),
+                        pc = abs(p-c);
+                    predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+                    break;
+                }
+            }
+            candidate[i+1] = row[i]-predictor;
+            sum += abs((signed char)candidate[i+1]);
+        }
+        if (best == NULL || sum < bestSum)
+        {
+            best = candidate;
+            bestSum = sum;
+        }
+    }
+    memcpy(filtered, best, rowBytes+1);
+}
+
+void filterBlock(void *arg, int index, int thread)
+{
+    (void)thread;
+    pngGroupJob *job = arg;
+    pngImage *image = job->image;
+    size_t rowBytes = image->width*image->components;
+    size_t first = index*image->blockRows,
+           last  = first+image->blockRows < image->pendingRows ? first+image->blockRows : image->pendingRows;
+    for (size_t row = first; row < last; row++)
+    {
+        const unsigned char *above = row > 0 ? image->rows+(row-1)*rowBytes : image->previous;
+        filterRow(image->rows+row*rowBytes, above, rowBytes, image->components,
+                  image->blocks[index].candidates, image->filtered+row*(rowBytes+1));
+    }
+}
+
+void deflateBlock(void *arg, int index, int thread)
+{
+    (void)thread;
+    pngGroupJob *job = arg;
+    pngImage *image = job->image;
+    struct pngBlock *block = &image->blocks[index];
+    size_t filteredBytes = image->width*image->components+1;
+    size_t first = index*image->blockRows,
+           last  = first+image->blockRows < image->pendingRows ? first+image->blockRows : image->pendingRows;
+    unsigned char *data = image->filtered+first*filteredBytes;
+    size_t length = (last-first)*filteredBytes;
+
+    // Every block is primed with the data before it, so splitting the image costs almost nothing in size
+    deflateReset(&block->stream);
+    if (index > 0)
+    {
+        size_t primed = first*filteredBytes < PNG_WINDOW_SIZE ? first*filteredBytes : PNG_WINDOW_SIZE;
+        deflateSetDictionary(&block->stream, data-primed, primed);
+    } else if (image->dictionaryLength > 0)
+    {
+        deflateSetDictionary(&block->stream, image->dictionary, image->dictionaryLength);
+    }
+    // Blocks end on a byte boundary (sync flush) so they can simply be concatenated,
+    // only the last block of the image ends the stream
+    int flush = job->final && index == job->blocks-1 ? Z_FINISH : Z_SYNC_FLUSH;
+    block->stream.next_in  = data;
+    block->stream.avail_in = length;
+    block->length = 0;
+    block->failed = 0;
+    int status;
+    do
+    {
+        if (block->length == block->capacity)
+        {
+            unsigned char *output = realloc(block->output, block->capacity*2);
+            if (output == NULL)
+            {
+                block->failed = 1;
+                return;
+            }
+            block->output = output;
+            block->capacity *= 2;
+        }
+        block->stream.next_out  = block->output+block->length;
+        block->stream.avail_out = block->capacity-block->length;
+        status = deflate(&block->stream, flush);
+        block->length = block->capacity-block->stream.avail_out;
+        if (status == Z_STREAM_ERROR)
+        {
+            block->failed = 1;
+            return;
+        }
+    } while (block->stream.avail_out == 0 || (flush == Z_FINISH && status != Z_STREAM_END));
+    block->adler = adler32(adler32(0, NULL, 0), data, length);
+}
+
+int deflateGroup(pngImage *image, int final)
+{
+    size_t rowBytes = image->width*image->components;
+    pngGroupJob job = {image, final, (image->pendingRows+image->blockRows-1)/image->blockRows};
+    // Blocks are primed with the filtered data before them, so every row is filtered before any is deflated
+    parallelPoolRun(image->pool, job.blocks, filterBlock, &job);
+    parallelPoolRun(image->pool, job.blocks, deflateBlock, &job);
+    for (int index = 0; index < job.blocks; index++)
+    {
+        struct pngBlock *block = &image->blocks[index];
+        size_t first = index*image->blockRows,
+               last  = first+image->blockRows < image->pendingRows ? first+image->blockRows : image->pendingRows;
+        if (block->failed || appendData(image, block->output, block->length) == 0)
+        {
+            return 0;
+        }
+        image->adler = adler32_combine(image->adler, block->adler, (last-first)*(rowBytes+1));
+    }
+
+    // The next group is filtered against this group's last row and primed with its last 32 KiB
+    size_t filteredLength = image->pendingRows*(rowBytes+1);
+    if (filteredLength >= PNG_WINDOW_SIZE)
+    {
+        memcpy(image->dictionary, image->filtered+filteredLength-PNG_WINDOW_SIZE, PNG_WINDOW_SIZE);
+        image->dictionaryLength = PNG_WINDOW_SIZE;
+    } else
+    {
+        size_t kept = image->dictionaryLength+filteredLength > PNG_WINDOW_SIZE ? PNG_WINDOW_SIZE-filteredLength : image->dictionaryLength;
+        memmove(image->dictionary, image->dictionary+image->dictionaryLength-kept, kept);
+        memcpy(image->dictionary+kept, image->filtered, filteredLength);
+        image->dictionaryLength = kept+filteredLength;
+    }
+    memcpy(image->previous, image->rows+(image->pendingRows-1)*rowBytes, rowBytes);
+    image->pendingRows = 0;
+    return 1;
+}
+
+int appendData(pngImage *image, const unsigned char *data, size_t length)
+{
+    while (length > 0)
+    {
+        size_t copied = PNG_CHUNK_SIZE-image->chunkLength < length ? PNG_CHUNK_SIZE-image->chunkLength : length;
+        memcpy(image->chunk+image->chunkLength, data, copied);
+        image->chunkLength += copied;
+        data += copied;
+        length -= copied;
+        if (image->chunkLength == PNG_CHUNK_SIZE)
+        {
+            if (writeChunk(image->file, "IDAT", image->chunk, PNG_CHUNK_SIZE) == 0)
+            {
+                return 0;
+            }
+            image->chunkLength = 0;
+        }
+    }
+    return 1;
+}
+
+int readBigEndian(FILE *file, unsigned long *value)
+{
+    unsigned char bytes[4];
+    if (fread(bytes, 1, 4, file) != 4)
+    {
+        return 0;
+    }
+    *value = (unsigned long)bytes[0] << 24 | (unsigned long)bytes[1] << 16 | (unsigned long)bytes[2] << 8 | bytes[3];
+    return 1;
+}
+
+int readCompressed(pngDecoder *image)
+{
+    // Chunks before the first IDAT are skipped, IDAT chunks have to be consecutive
+    while (image->chunkRemaining == 0)
+    {
+        unsigned long length;
+        unsigned char type[4];
+        // Skipping the CRC of the IDAT chunk just finished
+        if ((image->inData && fseeko(image->file, 4, SEEK_CUR) != 0) ||
+            readBigEndian(image->file, &length) == 0 || fread(type, 1, 4, image->file) != 4)
+        {
+            return 0;
+        }
+        if (memcmp(type, "IDAT", 4) == 0)
+        {
+            image->chunkRemaining = length;
+            image->inData = 1;
+        } else if (image->inData || memcmp(type, "IEND", 4) == 0 || fseeko(image->file, (off_t)length+4, SEEK_CUR) != 0)
+        {
+            return 0;
+        }
+    }
+    size_t read = image->chunkRemaining < PNG_CHUNK_SIZE ? image->chunkRemaining : PNG_CHUNK_SIZE;
+    if (fread(image->input, 1, read, image->file) != read)
+    {
+        return 0;
+    }
+    image->chunkRemaining -= read;
+    image->stream.next_in  = image->input;
+    image->stream.avail_in = read;
+    return 1;
+}
+
+void unfilterRow(pngDecoder *image)
+{
+    // The row is unfiltered in place, so every byte to the left is already unfiltered when it is used
+    size_t rowBytes = image->width*image->components;
+    int bpp = image->components;
+    unsigned char *row = image->filtered+1;
+    const unsigned char *above = image->previous+1;
+    int type = image->filtered[0];
+    for (size_t i = 0; i < rowBytes; i++)
+    {
+        // a is the byte to the left, b the one above and c the one above a
+        int a = i >= (size_t)bpp ? row[i-bpp] : 0,
+            b = above[i],
+            c = i >= (size_t)bpp ? above[i-bpp] : 0;
+        int predictor = 0;
+        switch (type)
+        {
+            case 1:
+                predictor = a;
+                break;
+            case 2:
+                predictor = b;
+                break;
+            case 3:
+                predictor = (a+b)/2;
+                break;
+            case 4:
+            {
+                int p = a+b-c,
+                    pa = abs(p-a),
+                    pb = abs(p-b),
+                    pc = abs(p-c);
+                predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+                break;
+            }
+        }
+        row[i] += predictor;
+    }
+    // The unfiltered row becomes the row above the next one
+    image->filtered = image->previous;
+    image->previous = row-1;
+}
+
+int readHeaderNumber(FILE *file, size_t *number)
+{
+    int c = fgetc(file);
+    while (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '#')
+    {
+        if (c == '#')
+        {
+            while (c != '\n' && c != EOF)
+            {
+                c = fgetc(file);
+            }
+        }
+        c = fgetc(file);
+    }
+    if (c < '0' || c > '9')
+    {
+        return 0;
+    }
+    *number = 0;
+    while (c >= '0' && c <= '9')
+    {
+        *number = *number*10+(c-'0');
+        c = fgetc(file);
+    }
+    // The character after the number is whitespace, which the caller may need to see
+    ungetc(c, file);
+    return 1;
+}
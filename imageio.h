@@ -0,0 +1,206 @@
+#ifndef IMAGEIO_H_INCLUDED
+#define IMAGEIO_H_INCLUDED
+
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "parallel.h"
+
+// Binary PGM (P5) or PPM (P6) file with 8-bit samples, read or written a few rows at a time
+// so an image never has to be held in memory as a whole
+typedef struct
+{
+    FILE *file;
+    size_t width;
+    size_t height;
+    // 1 for PGM, 3 for PPM
+    int components;
+    // Offset of the first row in the file
+    off_t data;
+} pnmImage;
+
+// Uncompressed image file mapped into memory copy-on-write, so pixels can be read (and
+// modified in place) without decoding the file and only the pages touched are loaded
+typedef struct
+{
+    void *mapping;
+    size_t length;
+    // First pixel of the image within the mapping
+    unsigned char *pixels;
+    size_t width;
+    size_t height;
+    int components;
+    // Distance in bytes between the starts of two rows
+    ptrdiff_t stride;
+} mappedImage;
+
+// Per block state of a pngImage, private to imageio.c
+struct pngBlock;
+
+// PNG file written a few rows at a time. Rows are gathered into groups of one block per
+// thread, every block of a group is filtered and deflated in parallel (as a raw deflate
+// stream primed with the 32 KiB before it and ended with a sync flush), and the blocks
+// are joined into a single zlib stream whose checksum is combined from theirs
+typedef struct
+{
+    FILE *file;
+    size_t width;
+    size_t height;
+    // 1 (gray), 2 (gray, alpha), 3 (RGB) or 4 (RGBA)
+    int components;
+    int level;
+    int threads;
+    // Workers filtering and deflating every group, started once for the whole image
+    parallelPool *pool;
+    size_t rowsWritten;
+    // Rows per block and rows gathered so far, the group is deflated once threads*blockRows are waiting
+    size_t blockRows;
+    size_t pendingRows;
+    // Waiting rows, their filtered versions (each a filter type byte followed by the filtered row)
+    // and the last row of the previous group (zeros before the first one)
+    unsigned char *rows;
+    unsigned char *filtered;
+    unsigned char *previous;
+    // Last (up to) 32 KiB of filtered data deflated so far
+    unsigned char *dictionary;
+    size_t dictionaryLength;
+    // Adler-32 of every filtered byte deflated so far
+    unsigned long adler;
+    struct pngBlock *blocks;
+    // Compressed data waiting to be written as an IDAT chunk
+    unsigned char *chunk;
+    size_t chunkLength;
+} pngImage;
+
+// PNG file read a few rows at a time, only 8-bit images without palette or interlacing
+// are supported, rows are inflated and unfiltered as they are read
+typedef struct
+{
+    FILE *file;
+    size_t width;
+    size_t height;
+    // 1 (gray), 2 (gray, alpha), 3 (RGB) or 4 (RGBA)
+    int components;
+    size_t rowsRead;
+    z_stream stream;
+    int inflating;
+    // Unread bytes of the current IDAT chunk, whether the IDAT chunks have been reached
+    // and compressed data read from them
+    unsigned long chunkRemaining;
+    int inData;
+    unsigned char *input;
+    // Current row and the unfiltered row before it, each behind its filter type byte
+    unsigned char *filtered;
+    unsigned char *previous;
+} pngDecoder;
+
+// File format of an imageSink
+typedef enum
+{
+    IMAGE_FORMAT_PNG,
+    IMAGE_FORMAT_PNM
+} imageFormat;
+
+// Output image that accepts rows incrementally, in either format
+typedef struct
+{
+    imageFormat format;
+    pnmImage pnm;
+    pngImage png;
+} imageSink;
+
+// pnmOpen() will open the PGM or PPM file at path and read its header into *image,
+// leaving the file at its first row. It will return a non-zero value on success.
+int pnmOpen(pnmImage *image, const char *path);
+
+// pnmCreate() will create a PGM (1 component) or PPM (3 components) file at path
+// and write its header. It will return a non-zero value on success.
+int pnmCreate(pnmImage *image, const char *path, size_t width, size_t height, int components);
+
+// pnmSeekRow() will move an opened *image to row, so the next read starts there.
+// It will return a non-zero value on success.
+int pnmSeekRow(pnmImage *image, size_t row);
+
+// pnmReadRows() will read the next rows rows of the pnmImage *image into *pixels,
+// rows are stride bytes apart, it can be used as a descreenRowReader.
+// It will return a non-zero value on success.
+int pnmReadRows(void *image, unsigned char *pixels, size_t rows, ptrdiff_t stride);
+
+// pnmWriteRows() will append rows rows from *pixels (stride bytes apart) to the pnmImage *image,
+// it can be used as a descreenRowWriter. It will return a non-zero value on success.
+int pnmWriteRows(void *image, const unsigned char *pixels, size_t rows, ptrdiff_t stride);
+
+// pnmClose() will close the file of *image, it will return 0 if anything
+// written to it could not be flushed.
+int pnmClose(pnmImage *image);
+
+// pngDecoderOpen() will open the PNG file at path and read its header into *image,
+// leaving it at its first row. It will return 0 if the file is not a PNG this decoder
+// supports, *image has to be closed with pngDecoderClose() either way.
+int pngDecoderOpen(pngDecoder *image, const char *path);
+
+// pngDecoderReadRows() will decode the next rows rows of the pngDecoder *image into *pixels,
+// rows are stride bytes apart, *pixels may be NULL to skip rows. It can be used as a
+// descreenRowReader. It will return a non-zero value on success.
+int pngDecoderReadRows(void *image, unsigned char *pixels, size_t rows, ptrdiff_t stride);
+
+// pngDecoderClose() will close the file of *image and free it, any rows not read are never decoded
+void pngDecoderClose(pngDecoder *image);
+
+// mapImage() will map the binary PGM or PPM file at path into *image.
+// It will return a non-zero value on success.
+int mapImage(mappedImage *image, const char *path);
+
+// mapRawImage() will map the file at path into *image as width x height pixels of components
+// interleaved 8-bit components with packed rows, starting offset bytes into the file. Only the
+// pages holding those pixels are mapped. It will return a non-zero value on success, or 0 if
+// the file is too small to hold the image.
+int mapRawImage(mappedImage *image, const char *path, size_t width, size_t height, int components, off_t offset);
+
+// detachImage() will copy the mapping of *image into memory of its own and unmap the file, so the
+// file can be truncated or overwritten while the image is still in use. unmapImage() frees the copy.
+// It will return a non-zero value on success, *image is left mapped otherwise.
+int detachImage(mappedImage *image);
+
+// unmapImage() will unmap the file mapped into *image, discarding any modification to its pixels
+void unmapImage(mappedImage *image);
+
+// sameFile() will return a non-zero value if path and other both exist and are the same file,
+// whatever names, symbolic links or hard links lead to it
+int sameFile(const char *path, const char *other);
+
+// pngCreate() will create a PNG file at path for a width x height image with components
+// interleaved 8-bit components per pixel, deflated at zlib level (0-9, or -1 for zlib's default)
+// by up to parallelThreads(threads) threads, and write its header. It will return a non-zero
+// value on success, *image has to be closed with pngClose() either way.
+int pngCreate(pngImage *image, const char *path, size_t width, size_t height, int components, int level, int threads);
+
+// pngWriteRows() will append rows rows from *pixels (stride bytes apart) to the pngImage *image,
+// deflating every full group of blocks, it can be used as a descreenRowWriter.
+// It will return a non-zero value on success.
+int pngWriteRows(void *image, const unsigned char *pixels, size_t rows, ptrdiff_t stride);
+
+// pngClose() will finish the PNG once every row has been written, close its file and
+// free *image. It will return 0 if the PNG is incomplete or could not be written.
+int pngClose(pngImage *image);
+
+// imageFormatFromPath() will return IMAGE_FORMAT_PNM for paths ending in .ppm, .pgm or .pnm
+// and IMAGE_FORMAT_PNG for anything else
+imageFormat imageFormatFromPath(const char *path);
+
+// imageSinkCreate() will create an image file at path in the format its extension names,
+// level and threads are used for PNG compression like pngCreate() does. PGM/PPM only hold 1 or 3
+// components. It will return a non-zero value on success, *sink has to be closed with imageSinkClose() either way.
+int imageSinkCreate(imageSink *sink, const char *path, size_t width, size_t height, int components, int level, int threads);
+
+// imageSinkWriteRows() will append rows rows from *pixels (stride bytes apart) to the imageSink *sink,
+// it can be used as a descreenRowWriter. It will return a non-zero value on success.
+int imageSinkWriteRows(void *sink, const unsigned char *pixels, size_t rows, ptrdiff_t stride);
+
+// imageSinkClose() will finish and close the file of *sink, it will return 0 if the
+// image is incomplete or could not be written.
+int imageSinkClose(imageSink *sink);
+
+#endif // IMAGEIO_H_INCLUDED
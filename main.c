@@ -1,54 +1,845 @@
-#include <stdio.h>
-#include <stdlib.h>
-
-#define STB_IMAGE_IMPLEMENTATION
-#define STBI_FAILURE_USERMSG
-#include "stb_image.h"
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
-#include "descreen.h"
-
-int main(int argc, char *argv[])
-{
-    if (argc < 4)
-    {
-        printf("Usage: %s [input] [output] [DPI]\n", argv[0]);
-        return 0;
-    }
-
-    printf("Reading input image...");
-    int width, height, comp;
-    // The final argument to this specifies the number of components to return,
-    // we will always be working with 3 (Red, Green and Blue)
-    // comp will be the original number of components  in the image
-    // It might be better to request 4 components here (RGBA) so we cant't throw away any information
-    unsigned char *pixels = stbi_load(argv[1], &width, &height, &comp, 3);
-    if (pixels == NULL)
-    {
-        printf("\nError reading image %s: %s", argv[1], stbi_failure_reason());
-        return 1;
-    }
-
-    descreenConfig config = {0};
-    config.pixels = pixels;
-    config.width  = width;
-    config.height = height;
-    config.dpi    = atoi(argv[3]);
-
-    // Hard-coded values for now, using a 1200x1200 image for testing, analyzed size will be 512x512 (2^9)
-    if (analyze(&config, 344, 344, 9) == 0)
-    {
-        printf("\nCould not detect screentone in input image.");
-        return 1;
-    }
-    printf("\nDetected screentone with parameters %iLPI and %ideg", config.lpi, config.angle);
-
-    // Descreen image
-
-    printf("\nWriting output image...");
-    // We will always output 24bit PNG for now, regardless of output extension
-    stbi_write_png(argv[2], width, height, 3, pixels, 0);
-
-    stbi_image_free(pixels);
-    return 0;
-}
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_FAILURE_USERMSG
+#include "stb_image.h"
+#include "descreen.h"
+#include "imageio.h"
+#include "batch.h"
+#include "parallel.h"
+
+// Path wisdom is saved to when the program exits, NULL if --wisdom was not given
+static const char *wisdomPath = NULL;
+// Set when several images are descreened at once, progress messages are left out as they would interleave
+static int batchMode = 0;
+// Set by --reuse-spectra, images are analyzed in the windows descreen() filters so it can reuse their spectra
+static int tileAnalysis = 0;
+
+// Report printed by --stats once everything is done
+typedef enum
+{
+    STATS_NONE,
+    STATS_TEXT,
+    STATS_JSON
+} statsFormat;
+
+// Pipeline stages of a batch run, in the order images pass through them
+enum
+{
+    BATCH_DECODE,
+    BATCH_ANALYZE,
+    BATCH_DESCREEN,
+    BATCH_ENCODE,
+    BATCH_STAGES
+};
+
+// Image passed through decodeImage(), analyzeImage(), descreenImage() and encodeImage(),
+// once one of them fails the ones after it skip the image
+typedef struct
+{
+    const char *inputPath;
+    const char *outputPath;
+    // Position in the batch, shown as the id of its trace events, -1 for a single image
+    int index;
+    descreenConfig config;
+    int level;
+    // Geometry of a raw input, rawWidth is 0 for anything else
+    size_t rawWidth;
+    size_t rawHeight;
+    int rawComponents;
+    // Input, either mapped or decoded
+    mappedImage mapped;
+    unsigned char *decoded;
+    descreenScreenMap map;
+    int failed;
+} imageJob;
+
+// Images of a batch run, one imageJob per entry of list
+typedef struct
+{
+    batchList *list;
+    imageJob *images;
+} batchRun;
+
+// Saves FFTW wisdom to wisdomPath, registered with atexit() so it runs on every exit path
+static void saveWisdom(void);
+// Parses a --planner value, returns 0 if it is not a known planner rigor
+static int parsePlanRigor(const char *name, descreenPlanRigor *rigor);
+// printf() for progress messages, prints nothing in batch mode
+static void progress(const char *format, ...);
+// Prints the time, bytes and count of every stage in *stats and the wall time of the run, as a table or as a JSON object
+static void printStats(const descreenStats *stats, double wallSeconds, statsFormat format);
+// Decodes (or maps) the image at inputPath whole, analyzes it in 512x512 (2^9) windows and descreens
+// the parts with a screentone into outputPath (PNG deflated at zlib level by config->threads threads, or
+// PGM/PPM depending on its extension). Returns 0 on failure, after printing why.
+static int descreenFile(const char *inputPath, const char *outputPath, descreenConfig *config, int level, size_t rawWidth, size_t rawHeight, int rawComponents);
+// Maps the input of *job, or decodes it whole if it cannot be mapped
+static void decodeImage(imageJob *job);
+// Analyzes the input of *job in 512x512 (2^9) windows, fails if no screentone is found
+static void analyzeImage(imageJob *job);
+// Descreens the parts of *job with a screentone in place
+static void descreenImage(imageJob *job);
+// Writes *job to its output unless an earlier step failed, then frees everything held by it
+static void encodeImage(imageJob *job);
+// pipelineStage jobs running one step on image index of the batchRun *arg, batchEncode() also reports the result
+static void batchDecode(void *arg, int index, int thread);
+static void batchAnalyze(void *arg, int index, int thread);
+static void batchDescreen(void *arg, int index, int thread);
+static void batchEncode(void *arg, int index, int thread);
+// pipelineStage job streaming image index of the batchRun *arg through streamImage()
+static void batchStream(void *arg, int index, int thread);
+// Prints whether image index of *run was descreened
+static void reportImage(const batchRun *run, int index);
+// Descreens every image of *list in a pipeline of decode, analysis, descreen and encode stages, with
+// stageThreads[stage] images in each stage at once and at most inFlight images held in memory. The
+// threads of *config are split between the images in the descreen stage. Streamed images go through a
+// single stage with stageThreads[BATCH_DESCREEN] threads instead. Every image shares the context of
+// *config, so plans are only made for the first one. Returns the number of images that failed.
+static size_t runBatch(batchList *list, const descreenConfig *config, int level, int stream, const int *stageThreads, int inFlight);
+// Analyzes a single row of 512x512 (2^9) windows from the middle of the image at inputPath, reading
+// as little of it as its format allows: mapped PGM/PPM/raw files only fault in the strip, PNG is
+// decoded up to the end of the strip and anything else is decoded whole. Sets width, height,
+// components, lpi and angle in *config, returns 0 on failure, after printing why.
+static int analyzeStrip(const char *inputPath, descreenConfig *config, size_t rawWidth, size_t rawHeight, int rawComponents);
+// Descreens the PGM, PPM or PNG file at inputPath into outputPath (PNG deflated at zlib level by
+// config->threads threads, or PGM/PPM depending on its extension) a band of rows at a time,
+// lpi and angle are taken from analyzeStrip(). Returns 0 on failure, after printing why.
+static int streamImage(const char *inputPath, const char *outputPath, descreenConfig *config, int level);
+
+int main(int argc, char *argv[])
+{
+    // Options may appear anywhere, everything else is a positional argument
+    char *positional[3] = {NULL};
+    int positionalCount = 0;
+    descreenPlanRigor rigor = DESCREEN_PLAN_ESTIMATE;
+    descreenTransform transform = DESCREEN_TRANSFORM_PLANAR;
+    descreenAnalysis analysis = DESCREEN_ANALYSIS_CHANNELS;
+    int stream = 0;
+    statsFormat stats = STATS_NONE;
+    // Chrome trace written once done, NULL if --trace was not given
+    const char *tracePath = NULL;
+    int analyzeOnly = 0;
+    int batch = 0;
+    // Images each batch stage works on at once, and images held by a batch, 0 for the sum of stageThreads
+    int stageThreads[BATCH_STAGES] = {1, 1, 1, 1};
+    int inFlight = 0;
+    // Manifest of a batch run, NULL if --manifest was not given
+    const char *manifestPath = NULL;
+    int level = 6;
+    int threads = 0;
+    // Megabytes of analysis spectra kept for the descreen pass, 0 unless --reuse-spectra was given
+    size_t spectrumBudget = 0;
+    // Width, height and components of a raw input, rawWidth is 0 unless --raw was given
+    size_t rawWidth = 0,
+           rawHeight = 0;
+    int rawComponents = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--wisdom") == 0 && i+1 < argc)
+        {
+            wisdomPath = argv[++i];
+        } else if (strcmp(argv[i], "--planner") == 0 && i+1 < argc)
+        {
+            if (parsePlanRigor(argv[++i], &rigor) == 0)
+            {
+                printf("Unknown planner %s, expected estimate, measure, patient or exhaustive\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--transform") == 0 && i+1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "planar") == 0)
+            {
+                transform = DESCREEN_TRANSFORM_PLANAR;
+            } else if (strcmp(argv[i], "packed") == 0)
+            {
+                transform = DESCREEN_TRANSFORM_PACKED;
+            } else
+            {
+                printf("Unknown transform %s, expected planar or packed\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--analysis") == 0 && i+1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "channels") == 0)
+            {
+                analysis = DESCREEN_ANALYSIS_CHANNELS;
+            } else if (strcmp(argv[i], "luma") == 0)
+            {
+                analysis = DESCREEN_ANALYSIS_LUMA;
+            } else
+            {
+                printf("Unknown analysis %s, expected channels or luma\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--reuse-spectra") == 0 && i+1 < argc)
+        {
+            i++;
+            if (sscanf(argv[i], "%zu", &spectrumBudget) != 1 || spectrumBudget == 0)
+            {
+                printf("Invalid spectrum budget %s, expected megabytes above 0\n", argv[i]);
+                return 1;
+            }
+            tileAnalysis = 1;
+        } else if (strcmp(argv[i], "--level") == 0 && i+1 < argc)
+        {
+            level = atoi(argv[++i]);
+            if (level < 0 || level > 9)
+            {
+                printf("Invalid compression level %s, expected 0 to 9\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+        {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--raw") == 0 && i+1 < argc)
+        {
+            i++;
+            if (sscanf(argv[i], "%zux%zux%d", &rawWidth, &rawHeight, &rawComponents) != 3 ||
+                rawWidth == 0 || rawHeight == 0 || rawComponents < 1 || rawComponents > 4)
+            {
+                printf("Invalid raw geometry %s, expected WIDTHxHEIGHTxCOMPONENTS\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--stream") == 0)
+        {
+            stream = 1;
+        } else if (strcmp(argv[i], "--stats") == 0 && i+1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "text") == 0)
+            {
+                stats = STATS_TEXT;
+            } else if (strcmp(argv[i], "json") == 0)
+            {
+                stats = STATS_JSON;
+            } else
+            {
+                printf("Unknown stats format %s, expected text or json\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--trace") == 0 && i+1 < argc)
+        {
+            tracePath = argv[++i];
+        } else if (strcmp(argv[i], "--analyze-only") == 0)
+        {
+            analyzeOnly = 1;
+        } else if (strcmp(argv[i], "--batch") == 0)
+        {
+            batch = 1;
+        } else if (strcmp(argv[i], "--manifest") == 0 && i+1 < argc)
+        {
+            manifestPath = argv[++i];
+        } else if (strcmp(argv[i], "--stages") == 0 && i+1 < argc)
+        {
+            i++;
+            if (sscanf(argv[i], "%d,%d,%d,%d", &stageThreads[BATCH_DECODE], &stageThreads[BATCH_ANALYZE],
+                       &stageThreads[BATCH_DESCREEN], &stageThreads[BATCH_ENCODE]) != BATCH_STAGES ||
+                stageThreads[BATCH_DECODE] < 1 || stageThreads[BATCH_ANALYZE] < 1 ||
+                stageThreads[BATCH_DESCREEN] < 1 || stageThreads[BATCH_ENCODE] < 1)
+            {
+                printf("Invalid stage threads %s, expected DECODE,ANALYZE,DESCREEN,ENCODE of at least 1 each\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--in-flight") == 0 && i+1 < argc)
+        {
+            inFlight = atoi(argv[++i]);
+            if (inFlight < 1)
+            {
+                printf("Invalid in-flight image count %s, expected at least 1\n", argv[i]);
+                return 1;
+            }
+        } else if (positionalCount < 3)
+        {
+            positional[positionalCount++] = argv[i];
+        }
+    }
+    if ((batch || manifestPath != NULL) && (analyzeOnly || rawWidth > 0))
+    {
+        printf("--analyze-only and --raw cannot be combined with --batch or --manifest\n");
+        return 1;
+    }
+    // An analyze-only run has no output and a manifest lists every input, output and DPI
+    if (analyzeOnly && positionalCount == 2)
+    {
+        positional[2] = positional[1];
+        positional[1] = NULL;
+    } else if (manifestPath == NULL && positionalCount < 3)
+    {
+        printf("Usage: %s [options] [input] [output] [DPI]\n", argv[0]);
+        printf("       %s [options] --batch [input directory or quoted glob] [output directory] [DPI]\n", argv[0]);
+        printf("       %s [options] --manifest [file]\n", argv[0]);
+        printf("Options:\n");
+        printf("  --wisdom [file]    Load FFTW wisdom from file at startup and save it on exit\n");
+        printf("  --planner [rigor]  FFTW planner rigor: estimate (default), measure, patient or exhaustive\n");
+        printf("  --transform [type] Channel transform: planar (default) or packed (two channels per complex FFT)\n");
+        printf("  --analysis [type]  Screentone analysis: channels (default) or luma (one FFT per window, per channel only when unsure)\n");
+        printf("  --reuse-spectra [MB] Analyze in the descreen windows and keep up to MB of their spectra,\n");
+        printf("                     so the descreen pass skips the forward FFT of those windows\n");
+        printf("  --stream           Descreen a PGM/PPM/PNG input a band at a time, with memory use independent of image height\n");
+        printf("  --analyze-only     Only detect the screentone, reading just a strip of the input, no output is given: %s --analyze-only [input] [DPI]\n", argv[0]);
+        printf("  --level [0-9]      PNG compression level (default 6), outputs ending in .ppm, .pgm or .pnm are written uncompressed\n");
+        printf("  --raw [WxHxC]      Input is raw 8-bit pixels, W x H pixels of C interleaved components (1-4)\n");
+        printf("  --threads [count]  Worker threads for descreening and PNG compression (default 0, every processor)\n");
+        printf("  --stats [format]   Print the time, bytes and count of every stage once done, as text or json\n");
+        printf("  --trace [file]     Write a Chrome trace of every stage, window and FFT to file, for chrome://tracing or Perfetto\n");
+        printf("  --batch            Descreen every image in a directory, or matching a glob, into PNG files of the same name\n");
+        printf("  --manifest [file]  Descreen a batch listed in file, one input, output and DPI per line separated by tabs\n");
+        printf("  --stages [D,A,S,E] Images a batch decodes, analyzes, descreens and encodes at once (default 1,1,1,1),\n");
+        printf("                     --threads is split between the images being descreened\n");
+        printf("  --in-flight [n]    Images a batch holds in memory at once (default the sum of --stages)\n");
+        return 0;
+    }
+    char *inputPath  = positional[0],
+         *outputPath = positional[1],
+         *dpi        = positional[2];
+
+    if (wisdomPath != NULL)
+    {
+        // A missing wisdom file is expected on the first run, it is created on exit
+        descreenLoadWisdom(wisdomPath);
+        atexit(saveWisdom);
+    }
+
+    // Analysis and descreening share one context, so the plans made for
+    // the analysis window are reused by the descreen pass
+    descreenContext *context = descreenCreateContext();
+    if (context == NULL)
+    {
+        printf("Error creating descreen context.");
+        return 1;
+    }
+    descreenSetPlanRigor(context, rigor);
+    descreenSetSpectrumBudget(context, spectrumBudget*1024*1024);
+
+    descreenConfig config = {0};
+    config.context = context;
+    config.dpi    = dpi != NULL ? atoi(dpi) : 0;
+    config.transform = transform;
+    config.analysis  = analysis;
+    config.threads   = threads;
+    descreenStats counters = {0};
+    config.stats = stats != STATS_NONE ? &counters : NULL;
+    config.trace = tracePath != NULL ? descreenTraceCreate() : NULL;
+    if (tracePath != NULL && config.trace == NULL)
+    {
+        printf("Error creating trace.");
+        descreenDestroyContext(context);
+        return 1;
+    }
+
+    double started = descreenStatsTime();
+    int succeeded;
+    if (batch || manifestPath != NULL)
+    {
+        batchList list = {0};
+        struct stat status;
+        int listed;
+        if (manifestPath != NULL)
+        {
+            listed = batchFromManifest(&list, manifestPath);
+        } else if (stat(inputPath, &status) == 0 && S_ISDIR(status.st_mode))
+        {
+            listed = batchFromDirectory(&list, inputPath, outputPath, config.dpi);
+        } else
+        {
+            listed = batchFromGlob(&list, inputPath, outputPath, config.dpi);
+        }
+        size_t failed = 1;
+        if (listed == 0 || list.count == 0)
+        {
+            printf("No images to descreen in %s\n", manifestPath != NULL ? manifestPath : inputPath);
+        } else if (batchCheckOutputs(&list))
+        {
+            failed = runBatch(&list, &config, level, stream, stageThreads, inFlight);
+            printf("Descreened %zu of %zu images\n", list.count-failed, list.count);
+        }
+        batchFree(&list);
+        succeeded = failed == 0;
+    } else if (analyzeOnly)
+    {
+        succeeded = analyzeStrip(inputPath, &config, rawWidth, rawHeight, rawComponents);
+    } else if (stream)
+    {
+        succeeded = streamImage(inputPath, outputPath, &config, level);
+    } else
+    {
+        succeeded = descreenFile(inputPath, outputPath, &config, level, rawWidth, rawHeight, rawComponents);
+    }
+    descreenDestroyContext(context);
+    if (stats != STATS_NONE)
+    {
+        printStats(&counters, descreenStatsTime()-started, stats);
+    }
+    if (config.trace != NULL)
+    {
+        if (descreenTraceWrite(config.trace, tracePath) == 0)
+        {
+            printf("\nError writing trace to %s", tracePath);
+            succeeded = 0;
+        }
+        descreenTraceDestroy(config.trace);
+    }
+    return succeeded ? 0 : 1;
+}
+
+void saveWisdom(void)
+{
+    if (descreenSaveWisdom(wisdomPath) == 0)
+    {
+        printf("\nError saving wisdom to %s", wisdomPath);
+    }
+}
+
+void progress(const char *format, ...)
+{
+    if (batchMode == 0)
+    {
+        va_list args;
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+    }
+}
+
+void printStats(const descreenStats *stats, double wallSeconds, statsFormat format)
+{
+    unsigned long long ffts = stats->count[DESCREEN_STAGE_FORWARD]+stats->count[DESCREEN_STAGE_INVERSE];
+    if (format == STATS_JSON)
+    {
+        printf("\n{\"wallSeconds\": %.6f, \"ffts\": %llu, \"stages\": {", wallSeconds, ffts);
+        for (int stage = 0; stage < DESCREEN_STAGES; stage++)
+        {
+            printf("%s\"%s\": {\"seconds\": %.6f, \"bytes\": %llu, \"count\": %llu}", stage > 0 ? ", " : "",
+                   descreenStageName(stage), stats->seconds[stage], stats->bytes[stage], stats->count[stage]);
+        }
+        printf("}}\n");
+        return;
+    }
+    // Stage times are summed over every thread, so with several threads they can add up to more than the wall time
+    printf("\n%-10s %12s %16s %10s %10s\n", "Stage", "Seconds", "Bytes", "MB/s", "Count");
+    for (int stage = 0; stage < DESCREEN_STAGES; stage++)
+    {
+        double rate = stats->seconds[stage] > 0 ? stats->bytes[stage]/stats->seconds[stage]/1e6 : 0;
+        printf("%-10s %12.4f %16llu %10.1f %10llu\n", descreenStageName(stage), stats->seconds[stage], stats->bytes[stage], rate, stats->count[stage]);
+    }
+    printf("Wall time %.4f seconds, %llu FFTs\n", wallSeconds, ffts);
+}
+
+int descreenFile(const char *inputPath, const char *outputPath, descreenConfig *config, int level, size_t rawWidth, size_t rawHeight, int rawComponents)
+{
+    imageJob job = {0};
+    job.inputPath  = inputPath;
+    job.outputPath = outputPath;
+    job.index = -1;
+    job.config = *config;
+    job.level  = level;
+    job.rawWidth  = rawWidth;
+    job.rawHeight = rawHeight;
+    job.rawComponents = rawComponents;
+    decodeImage(&job);
+    analyzeImage(&job);
+    descreenImage(&job);
+    encodeImage(&job);
+    return job.failed == 0;
+}
+
+void decodeImage(imageJob *job)
+{
+    descreenConfig *config = &job->config;
+    progress("Reading input image...");
+    double clock = descreenStatsTime();
+    descreenTraceBegin(config->trace, "decode", job->index);
+    // Binary PGM/PPM and raw files are mapped rather than decoded, so no copy of the image is made
+    // and only the pages the analysis and descreen passes touch are read
+    if (job->rawWidth > 0 ? mapRawImage(&job->mapped, job->inputPath, job->rawWidth, job->rawHeight, job->rawComponents, 0)
+                          : mapImage(&job->mapped, job->inputPath))
+    {
+        // Creating the output truncates its file, which would drop the pages behind the mapping,
+        // so an input that is also the output (by any name) is copied into memory first
+        if (sameFile(job->inputPath, job->outputPath) && detachImage(&job->mapped) == 0)
+        {
+            printf("\nError reading image %s: out of memory", job->inputPath);
+            unmapImage(&job->mapped);
+            job->failed = 1;
+        }
+        config->pixels = job->mapped.pixels;
+        config->width  = job->mapped.width;
+        config->height = job->mapped.height;
+        config->components = job->mapped.components;
+        config->stride = job->mapped.stride;
+    } else if (job->rawWidth > 0)
+    {
+        printf("\nError reading image %s: file is too small for a %zux%zu image with %i components",
+               job->inputPath, job->rawWidth, job->rawHeight, job->rawComponents);
+        job->failed = 1;
+    } else
+    {
+        int width, height, comp;
+        // Requesting 0 components keeps the image's own layout, gray (1), gray and alpha (2),
+        // RGB (3) or RGBA (4), grayscale scans are filtered as a single channel and alpha is kept
+        job->decoded = stbi_load(job->inputPath, &width, &height, &comp, 0);
+        if (job->decoded == NULL)
+        {
+            printf("\nError reading image %s: %s", job->inputPath, stbi_failure_reason());
+            job->failed = 1;
+        } else
+        {
+            config->pixels = job->decoded;
+            config->width  = width;
+            config->height = height;
+            config->components = comp;
+            config->stride = (ptrdiff_t)width*comp;
+        }
+    }
+    descreenTraceEnd(config->trace, "decode");
+    // Mapped inputs are only read once they are used, their pages are faulted in by the fill stage
+    if (job->failed == 0)
+    {
+        descreenStatsAdd(config->stats, DESCREEN_STAGE_DECODE, descreenStatsTime()-clock, config->height*config->width*config->components, 1);
+    }
+}
+
+void analyzeImage(imageJob *job)
+{
+    if (job->failed)
+    {
+        return;
+    }
+    // Analyzing the whole image in 512x512 (2^9) windows, areas without the screentone
+    // are left out of the descreen pass
+    descreenTraceBegin(job->config.trace, "analyze", job->index);
+    int detected = tileAnalysis ? analyzeTiles(&job->config, 9, &job->map) : analyzeGrid(&job->config, 9, 0, 0, &job->map);
+    descreenTraceEnd(job->config.trace, "analyze");
+    if (detected == 0)
+    {
+        printf("\nCould not detect screentone in input image %s.", job->inputPath);
+        job->failed = 1;
+        return;
+    }
+    job->config.screenMap = &job->map;
+    progress("\nDetected screentone with parameters %iLPI and %ideg (%.0f%% of the image)", job->config.lpi, job->config.angle, job->map.confidence*100);
+}
+
+void descreenImage(imageJob *job)
+{
+    if (job->failed)
+    {
+        return;
+    }
+    progress("\nDescreening image...");
+    // Using the same 512x512 (2^9) window size that was used for analysis
+    descreenTraceBegin(job->config.trace, "descreen", job->index);
+    int descreened = descreen(&job->config, 9);
+    descreenTraceEnd(job->config.trace, "descreen");
+    if (descreened == 0)
+    {
+        printf("\nError descreening image %s.", job->inputPath);
+        job->failed = 1;
+    }
+}
+
+void encodeImage(imageJob *job)
+{
+    descreenConfig *config = &job->config;
+    if (job->failed == 0)
+    {
+        progress("\nWriting output image...");
+        double clock = descreenStatsTime();
+        descreenTraceBegin(config->trace, "encode", job->index);
+        // Rows are deflated straight from *pixels, without a filtered copy of the whole image
+        imageSink output;
+        int written = imageSinkCreate(&output, job->outputPath, config->width, config->height, config->components, job->level, config->threads) &&
+                      imageSinkWriteRows(&output, config->pixels, config->height, config->stride);
+        if (imageSinkClose(&output) == 0 || written == 0)
+        {
+            printf("\nError writing output image %s.", job->outputPath);
+            job->failed = 1;
+        }
+        descreenTraceEnd(config->trace, "encode");
+        descreenStatsAdd(config->stats, DESCREEN_STAGE_ENCODE, descreenStatsTime()-clock, config->height*config->width*config->components, 1);
+    }
+    freeScreenMap(&job->map);
+    unmapImage(&job->mapped);
+    stbi_image_free(job->decoded);
+    job->decoded = NULL;
+    config->screenMap = NULL;
+    config->pixels = NULL;
+}
+
+void batchDecode(void *arg, int index, int thread)
+{
+    (void)thread;
+    imageJob *job = &((batchRun*)arg)->images[index];
+    decodeImage(job);
+}
+
+void batchAnalyze(void *arg, int index, int thread)
+{
+    (void)thread;
+    analyzeImage(&((batchRun*)arg)->images[index]);
+}
+
+void batchDescreen(void *arg, int index, int thread)
+{
+    (void)thread;
+    descreenImage(&((batchRun*)arg)->images[index]);
+}
+
+void batchEncode(void *arg, int index, int thread)
+{
+    (void)thread;
+    batchRun *run = arg;
+    encodeImage(&run->images[index]);
+    reportImage(run, index);
+}
+
+void batchStream(void *arg, int index, int thread)
+{
+    (void)thread;
+    batchRun *run = arg;
+    imageJob *job = &run->images[index];
+    job->failed = streamImage(job->inputPath, job->outputPath, &job->config, job->level) == 0;
+    reportImage(run, index);
+}
+
+void reportImage(const batchRun *run, int index)
+{
+    const imageJob *job = &run->images[index];
+    if (job->failed == 0)
+    {
+        printf("\n[%i/%zu] %s: %iLPI and %ideg, written to %s", index+1, run->list->count, job->inputPath, job->config.lpi, job->config.angle, job->outputPath);
+    } else
+    {
+        printf("\n[%i/%zu] %s: failed", index+1, run->list->count, job->inputPath);
+    }
+}
+
+size_t runBatch(batchList *list, const descreenConfig *config, int level, int stream, const int *stageThreads, int inFlight)
+{
+    batchRun run;
+    run.list   = list;
+    run.images = calloc(list->count, sizeof(imageJob));
+    if (run.images == NULL)
+    {
+        return list->count;
+    }
+    // Each image being descreened gets an equal share of the worker threads, decoding and
+    // encoding of other images overlaps its transforms
+    int threads = parallelThreads(config->threads)/stageThreads[BATCH_DESCREEN];
+    for (size_t i = 0; i < list->count; i++)
+    {
+        imageJob *job = &run.images[i];
+        job->inputPath  = list->entries[i].input;
+        job->outputPath = list->entries[i].output;
+        job->index = i;
+        job->config = *config;
+        job->config.dpi = list->entries[i].dpi;
+        job->config.threads = threads > 0 ? threads : 1;
+        job->level = level;
+    }
+
+    pipelineStage stages[BATCH_STAGES];
+    stages[BATCH_DECODE].job   = batchDecode;
+    stages[BATCH_ANALYZE].job  = batchAnalyze;
+    stages[BATCH_DESCREEN].job = batchDescreen;
+    stages[BATCH_ENCODE].job   = batchEncode;
+    int stageCount = BATCH_STAGES;
+    if (stream)
+    {
+        // Streamed images are never held whole, so reading, descreening and writing one cannot be split
+        stages[0].job = batchStream;
+        stages[0].threads = stageThreads[BATCH_DESCREEN];
+        stageCount = 1;
+    } else
+    {
+        for (int stage = 0; stage < BATCH_STAGES; stage++)
+        {
+            stages[stage].threads = stageThreads[stage];
+        }
+    }
+    if (inFlight <= 0)
+    {
+        inFlight = 0;
+        for (int stage = 0; stage < stageCount; stage++)
+        {
+            inFlight += stages[stage].threads;
+        }
+    }
+
+    batchMode = 1;
+    int ran = pipelineRun(stages, stageCount, (int)list->count, inFlight, &run);
+    batchMode = 0;
+    printf("\n");
+
+    // Nothing was started if the pipeline could not be set up
+    size_t failed = ran ? 0 : list->count;
+    for (size_t i = 0; ran && i < list->count; i++)
+    {
+        failed += run.images[i].failed != 0;
+    }
+    free(run.images);
+    return failed;
+}
+int analyzeStrip(const char *inputPath, descreenConfig *config, size_t rawWidth, size_t rawHeight, int rawComponents)
+{
+    progress("Reading input image...");
+    double clock = descreenStatsTime();
+    descreenConfig strip = *config;
+    mappedImage mapped;
+    pngDecoder png = {0};
+    unsigned char *rows = NULL,
+                  *decoded = NULL;
+    size_t first = 0;
+    int read = 0;
+    if (rawWidth > 0 ? mapRawImage(&mapped, inputPath, rawWidth, rawHeight, rawComponents, 0) : mapImage(&mapped, inputPath))
+    {
+        config->width  = mapped.width;
+        config->height = mapped.height;
+        config->components = mapped.components;
+        strip.height = config->height < 512 ? config->height : 512;
+        first = (config->height-strip.height)/2;
+        strip.pixels = mapped.pixels+first*mapped.stride;
+        strip.stride = mapped.stride;
+        read = 1;
+    } else if (rawWidth == 0 && pngDecoderOpen(&png, inputPath))
+    {
+        config->width  = png.width;
+        config->height = png.height;
+        config->components = png.components;
+        strip.height = config->height < 512 ? config->height : 512;
+        first = (config->height-strip.height)/2;
+        strip.stride = png.width*png.components;
+        rows = malloc(strip.height*strip.stride);
+        strip.pixels = rows;
+        // Rows before the strip still have to be inflated, but rows after it never are
+        read = rows != NULL && pngDecoderReadRows(&png, NULL, first, 0) &&
+               pngDecoderReadRows(&png, rows, strip.height, strip.stride);
+    } else if (rawWidth == 0)
+    {
+        int width, height, comp;
+        decoded = stbi_load(inputPath, &width, &height, &comp, 0);
+        if (decoded != NULL)
+        {
+            config->width  = width;
+            config->height = height;
+            config->components = comp;
+            strip.height = config->height < 512 ? config->height : 512;
+            first = (config->height-strip.height)/2;
+            strip.stride = (ptrdiff_t)width*comp;
+            strip.pixels = decoded+first*strip.stride;
+            read = 1;
+        }
+    }
+    strip.width = config->width;
+    strip.components = config->components;
+    pngDecoderClose(&png);
+    if (read)
+    {
+        descreenStatsAdd(config->stats, DESCREEN_STAGE_DECODE, descreenStatsTime()-clock, strip.height*strip.width*strip.components, 1);
+    }
+
+    int detected = 0;
+    descreenScreenMap map = {0};
+    if (read == 0)
+    {
+        printf("\nError reading image %s.", inputPath);
+    } else if ((detected = analyzeGrid(&strip, 9, 0, 1, &map)) == 0)
+    {
+        printf("\nCould not detect screentone in input image.");
+    } else
+    {
+        config->lpi   = strip.lpi;
+        config->angle = strip.angle;
+        progress("\nDetected screentone with parameters %iLPI and %ideg (%.0f%% of rows %zu to %zu)",
+                 config->lpi, config->angle, map.confidence*100, first, first+strip.height-1);
+    }
+    freeScreenMap(&map);
+    free(rows);
+    stbi_image_free(decoded);
+    unmapImage(&mapped);
+    return detected;
+}
+
+int streamImage(const char *inputPath, const char *outputPath, descreenConfig *config, int level)
+{
+    // Rows are still read from the input while the output is written, truncating it would lose them
+    if (sameFile(inputPath, outputPath))
+    {
+        printf("\nOutput %s would overwrite its input, it cannot be streamed.", outputPath);
+        return 0;
+    }
+    if (analyzeStrip(inputPath, config, 0, 0, 0) == 0)
+    {
+        return 0;
+    }
+    pnmImage pnm;
+    pngDecoder png = {0};
+    descreenRowReader reader = pnmReadRows;
+    void *readerData = &pnm;
+    if (pnmOpen(&pnm, inputPath) == 0)
+    {
+        reader = pngDecoderReadRows;
+        readerData = &png;
+        if (pngDecoderOpen(&png, inputPath) == 0)
+        {
+            printf("\nError reading image %s: streaming needs a PGM, PPM or PNG file with 8-bit samples", inputPath);
+            pngDecoderClose(&png);
+            return 0;
+        }
+    }
+
+    imageSink output;
+    int streamed = 0;
+    int created = imageSinkCreate(&output, outputPath, config->width, config->height, config->components, level, config->threads);
+    if (created == 0)
+    {
+        printf("\nError creating output image %s.", outputPath);
+    } else
+    {
+        progress("\nDescreening image...");
+        streamed = descreenStream(config, 9, reader, readerData, imageSinkWriteRows, &output);
+    }
+    if (reader == pnmReadRows)
+    {
+        pnmClose(&pnm);
+    } else
+    {
+        pngDecoderClose(&png);
+    }
+    if (imageSinkClose(&output) == 0 || streamed == 0)
+    {
+        if (created)
+        {
+            printf("\nError descreening image.");
+        }
+        return 0;
+    }
+    return 1;
+}
+
+int parsePlanRigor(const char *name, descreenPlanRigor *rigor)
+{
+    if (strcmp(name, "estimate") == 0)
+    {
+        *rigor = DESCREEN_PLAN_ESTIMATE;
+    } else if (strcmp(name, "measure") == 0)
+    {
+        *rigor = DESCREEN_PLAN_MEASURE;
+    } else if (strcmp(name, "patient") == 0)
+    {
+        *rigor = DESCREEN_PLAN_PATIENT;
+    } else if (strcmp(name, "exhaustive") == 0)
+    {
+        *rigor = DESCREEN_PLAN_EXHAUSTIVE;
+    } else
+    {
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,378 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "parallel.h"
+
+struct parallelPool
+{
+    // Workers including the calling thread, and the worker threads actually started
+    int threads;
+    int started;
+    pthread_t *handles;
+    struct parallelWorker *workers;
+    pthread_mutex_t lock;
+    // Signalled when a round of jobs is posted or the pool is stopping, and when the last worker leaves a round
+    pthread_cond_t posted;
+    pthread_cond_t finished;
+    // Bumped for every round, so a worker can tell a new round from the one it has already left
+    unsigned round;
+    int stopping;
+    // Jobs of the current round, the next one to take and the worker threads still taking them
+    parallelJob job;
+    void *arg;
+    int jobs;
+    int next;
+    int busy;
+};
+
+typedef struct parallelWorker
+{
+    parallelPool *pool;
+    int thread;
+} parallelWorker;
+
+// Items waiting for a pipeline stage, a ring of pipeline->inFlight entries
+typedef struct
+{
+    int *items;
+    int first;
+    int count;
+    // Set if no thread could be started for the stage, its items are then taken by the calling thread
+    int starved;
+} pipelineQueue;
+
+typedef struct
+{
+    const pipelineStage *stages;
+    int stageCount;
+    void *arg;
+    int items;
+    int inFlight;
+    // Next item to enter the first stage, items in the pipeline and items that have left it
+    int next;
+    int entered;
+    int finished;
+    // One queue per stage after the first
+    pipelineQueue *queues;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} pipelineState;
+
+typedef struct
+{
+    pipelineState *pipeline;
+    int stage;
+    int thread;
+} pipelineWorker;
+
+// Worker thread entry point, takes part in every round of jobs posted to its pool until it is stopping
+static void *parallelServe(void *arg);
+// Runs jobs of the current round of *pool as thread until none is left, with the pool locked
+static void parallelTakeJobs(parallelPool *pool, int thread);
+// Takes the next item waiting for stage, with the pipeline locked. Returns -1 if there is none.
+static int pipelineTake(pipelineState *pipeline, int stage);
+// Pipeline worker thread entry point, runs the job of its stage (or of every starved stage if its
+// stage is -1) on the items that reach it until every item is finished
+static void *pipelineRunStage(void *arg);
+
+int parallelThreads(int threads)
+{
+    if (threads > 0)
+    {
+        return threads;
+    }
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    return processors > 0 ? (int)processors : 1;
+}
+
+int parallelFor(int threads, int jobs, parallelJob job, void *arg)
+{
+    threads = parallelThreads(threads);
+    if (threads > jobs)
+    {
+        threads = jobs;
+    }
+    // Not worth spinning up threads for a single worker
+    if (threads <= 1)
+    {
+        for (int index = 0; index < jobs; index++)
+        {
+            job(arg, index, 0);
+        }
+        return 1;
+    }
+    parallelPool *pool = parallelPoolCreate(threads);
+    if (pool == NULL)
+    {
+        return 0;
+    }
+    parallelPoolRun(pool, jobs, job, arg);
+    parallelPoolDestroy(pool);
+    return 1;
+}
+
+parallelPool *parallelPoolCreate(int threads)
+{
+    threads = parallelThreads(threads);
+    parallelPool *pool = calloc(1, sizeof(parallelPool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pool->handles = malloc(sizeof(pthread_t)*threads);
+    pool->workers = malloc(sizeof(parallelWorker)*threads);
+    if (pool->handles == NULL || pool->workers == NULL)
+    {
+        free(pool->workers);
+        free(pool->handles);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->posted, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+    // Worker 0 runs on the calling thread, the rest get their own thread
+    for (int thread = 1; thread < threads; thread++)
+    {
+        parallelWorker *worker = &pool->workers[pool->started+1];
+        worker->pool   = pool;
+        worker->thread = pool->started+1;
+        if (pthread_create(&pool->handles[pool->started+1], NULL, parallelServe, worker) == 0)
+        {
+            pool->started++;
+        }
+    }
+    pool->threads = pool->started+1;
+    return pool;
+}
+
+int parallelPoolThreads(const parallelPool *pool)
+{
+    return pool->threads;
+}
+
+void parallelPoolRun(parallelPool *pool, int jobs, parallelJob job, void *arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->job  = job;
+    pool->arg  = arg;
+    pool->jobs = jobs;
+    pool->next = 0;
+    pool->busy = pool->started;
+    pool->round++;
+    pthread_cond_broadcast(&pool->posted);
+    parallelTakeJobs(pool, 0);
+    // Every worker has to leave the round before its jobs can be replaced by the next one
+    while (pool->busy > 0)
+    {
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void parallelPoolDestroy(parallelPool *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->posted);
+    pthread_mutex_unlock(&pool->lock);
+    for (int thread = 1; thread <= pool->started; thread++)
+    {
+        pthread_join(pool->handles[thread], NULL);
+    }
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->posted);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool->handles);
+    free(pool);
+}
+
+void *parallelServe(void *arg)
+{
+    parallelWorker *worker = arg;
+    parallelPool *pool = worker->pool;
+    unsigned round = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (pool->round == round && pool->stopping == 0)
+        {
+            pthread_cond_wait(&pool->posted, &pool->lock);
+        }
+        if (pool->stopping)
+        {
+            break;
+        }
+        round = pool->round;
+        parallelTakeJobs(pool, worker->thread);
+        if (--pool->busy == 0)
+        {
+            pthread_cond_signal(&pool->finished);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void parallelTakeJobs(parallelPool *pool, int thread)
+{
+    while (pool->next < pool->jobs)
+    {
+        int index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->job(pool->arg, index, thread);
+        pthread_mutex_lock(&pool->lock);
+    }
+}
+
+int pipelineRun(const pipelineStage *stages, int stageCount, int items, int inFlight, void *arg)
+{
+    if (stageCount <= 0 || items <= 0)
+    {
+        return 1;
+    }
+    pipelineState pipeline = {0};
+    pipeline.stages     = stages;
+    pipeline.stageCount = stageCount;
+    pipeline.arg        = arg;
+    pipeline.items      = items;
+    pipeline.inFlight   = inFlight > 0 ? inFlight : 1;
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.changed, NULL);
+
+    // Every item a queue could hold is in flight, so inFlight entries are always enough
+    pipeline.queues = calloc(stageCount, sizeof(pipelineQueue));
+    int workerCount = 0,
+        allocated = pipeline.queues != NULL;
+    for (int stage = 0; allocated && stage < stageCount; stage++)
+    {
+        pipeline.queues[stage].items = malloc(sizeof(int)*pipeline.inFlight);
+        allocated = pipeline.queues[stage].items != NULL;
+        workerCount += stages[stage].threads > 0 ? stages[stage].threads : 1;
+    }
+    pthread_t *handles = allocated ? malloc(sizeof(pthread_t)*workerCount) : NULL;
+    pipelineWorker *workers = allocated ? malloc(sizeof(pipelineWorker)*(workerCount+1)) : NULL;
+    if (handles == NULL || workers == NULL)
+    {
+        for (int stage = 0; pipeline.queues != NULL && stage < stageCount; stage++)
+        {
+            free(pipeline.queues[stage].items);
+        }
+        free(pipeline.queues);
+        free(workers);
+        free(handles);
+        pthread_cond_destroy(&pipeline.changed);
+        pthread_mutex_destroy(&pipeline.lock);
+        return 0;
+    }
+    int started = 0;
+    for (int stage = 0; stage < stageCount; stage++)
+    {
+        int threads = stages[stage].threads > 0 ? stages[stage].threads : 1;
+        int stageStarted = 0;
+        for (int thread = 0; thread < threads; thread++)
+        {
+            workers[started].pipeline = &pipeline;
+            workers[started].stage    = stage;
+            workers[started].thread   = stageStarted;
+            if (pthread_create(&handles[started], NULL, pipelineRunStage, &workers[started]) == 0)
+            {
+                started++;
+                stageStarted++;
+            }
+        }
+        pipeline.queues[stage].starved = stageStarted == 0;
+    }
+    // The calling thread runs every stage that did not get a thread of its own,
+    // as thread 0 of that stage, and otherwise just waits for the workers
+    workers[started].pipeline = &pipeline;
+    workers[started].stage    = -1;
+    workers[started].thread   = 0;
+    pipelineRunStage(&workers[started]);
+
+    for (int worker = 0; worker < started; worker++)
+    {
+        pthread_join(handles[worker], NULL);
+    }
+    for (int stage = 0; stage < stageCount; stage++)
+    {
+        free(pipeline.queues[stage].items);
+    }
+    free(pipeline.queues);
+    free(workers);
+    free(handles);
+    pthread_cond_destroy(&pipeline.changed);
+    pthread_mutex_destroy(&pipeline.lock);
+    return 1;
+}
+
+int pipelineTake(pipelineState *pipeline, int stage)
+{
+    pipelineQueue *queue = &pipeline->queues[stage];
+    if (queue->count > 0)
+    {
+        int item = queue->items[queue->first];
+        queue->first = (queue->first+1)%pipeline->inFlight;
+        queue->count--;
+        return item;
+    }
+    // Backpressure, the first stage only starts on a new item once an item has left the pipeline
+    if (stage == 0 && pipeline->next < pipeline->items && pipeline->entered < pipeline->inFlight)
+    {
+        pipeline->entered++;
+        return pipeline->next++;
+    }
+    return -1;
+}
+
+void *pipelineRunStage(void *arg)
+{
+    pipelineWorker *worker = arg;
+    pipelineState *pipeline = worker->pipeline;
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->finished < pipeline->items)
+    {
+        int stage = worker->stage,
+            item = -1;
+        if (stage >= 0)
+        {
+            item = pipelineTake(pipeline, stage);
+        } else
+        {
+            // Later stages first, so items already in the pipeline are finished before new ones enter
+            for (stage = pipeline->stageCount-1; stage >= 0 && item < 0; stage--)
+            {
+                item = pipeline->queues[stage].starved ? pipelineTake(pipeline, stage) : -1;
+            }
+            stage++;
+        }
+        if (item < 0)
+        {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pipeline->lock);
+        pipeline->stages[stage].job(pipeline->arg, item, worker->thread);
+        pthread_mutex_lock(&pipeline->lock);
+
+        if (stage+1 < pipeline->stageCount)
+        {
+            pipelineQueue *next = &pipeline->queues[stage+1];
+            next->items[(next->first+next->count)%pipeline->inFlight] = item;
+            next->count++;
+        } else
+        {
+            pipeline->entered--;
+            pipeline->finished++;
+        }
+        pthread_cond_broadcast(&pipeline->changed);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
@@ -0,0 +1,54 @@
+#ifndef PARALLEL_H_INCLUDED
+#define PARALLEL_H_INCLUDED
+
+// Job callback used by parallelFor(), index is the job being run and thread is the
+// index of the worker running it (always smaller than the resolved thread count)
+typedef void (*parallelJob)(void *arg, int index, int thread);
+
+// parallelThreads() will resolve a requested thread count, if threads is 0 or less
+// it will return the number of online processors, otherwise it returns threads.
+int parallelThreads(int threads);
+
+// Worker threads started once and reused by every parallelPoolRun(), so work split into many short
+// rounds does not pay for creating and joining threads each time
+typedef struct parallelPool parallelPool;
+
+// parallelFor() will run job(arg, index, thread) for every index in [0, jobs),
+// distributing the indices over up to parallelThreads(threads) worker threads.
+// It returns once every job has finished, with a non-zero value, or with 0
+// without running any job if out of memory.
+int parallelFor(int threads, int jobs, parallelJob job, void *arg);
+
+// parallelPoolCreate() will start parallelThreads(threads)-1 worker threads that wait for
+// parallelPoolRun(), the calling thread of which is always worker 0. If some threads cannot
+// be started the pool works with fewer. It will return NULL if out of memory.
+parallelPool *parallelPoolCreate(int threads);
+
+// parallelPoolThreads() will return the number of workers of *pool, including the calling thread
+int parallelPoolThreads(const parallelPool *pool);
+
+// parallelPoolRun() will run job(arg, index, thread) for every index in [0, jobs) on the workers of
+// *pool, with thread smaller than parallelPoolThreads(pool). It returns once every job has finished.
+// Only one thread may run jobs on a pool at a time.
+void parallelPoolRun(parallelPool *pool, int jobs, parallelJob job, void *arg);
+
+// parallelPoolDestroy() will stop and join every worker thread of *pool and free it,
+// it does nothing if pool is NULL
+void parallelPoolDestroy(parallelPool *pool);
+
+// Stage of a pipeline, job runs on up to threads threads at once, each call working on a different item
+typedef struct
+{
+    parallelJob job;
+    int threads;
+} pipelineStage;
+
+// pipelineRun() will pass every item in [0, items) through stages[0] to stages[stageCount-1] in order,
+// calling stages[stage].job(arg, item, thread) with thread smaller than stages[stage].threads. Items wait
+// for the next stage in bounded queues, and a new item only enters the first stage while fewer than
+// inFlight items are in the pipeline, so at most inFlight items are held at once. It returns once
+// every item has passed the last stage, with a non-zero value, or with 0 without running any stage
+// if out of memory.
+int pipelineRun(const pipelineStage *stages, int stageCount, int items, int inFlight, void *arg);
+
+#endif // PARALLEL_H_INCLUDED
@@ -0,0 +1,300 @@
+#include "peaks.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define PEAKS_X86
+    #include <immintrin.h>
+#endif
+
+// Checks a single bin, used for rows and columns at the edges of the plane where
+// some neighbours are missing, and for whatever is left over after the vector loop
+static void scanBin(const descreenReal *power, int width, int height, int row, int column, peakSearch *result);
+// Searches every bin the vector loops don't handle in a row: everything when the row lacks
+// a neighbour row, otherwise the first column and the columns outside [vectorStart, vectorEnd)
+static void scanRowEdges(const descreenReal *power, int width, int height, int row, int start,
+                         int vectorStart, int vectorEnd, peakSearch *result);
+static void findPeakScalar(const descreenReal *power, int width, int height, const int *rowStart, peakSearch *result);
+#ifdef PEAKS_X86
+static void findPeakSSE2(const descreenReal *power, int width, int height, const int *rowStart, peakSearch *result);
+static void findPeakAVX2(const descreenReal *power, int width, int height, const int *rowStart, peakSearch *result);
+#endif
+
+void findPeak(const descreenReal *power, int width, int height, const int *rowStart, peakSearch *result)
+{
+    result->power  = 0;
+    result->column = 0;
+    result->row    = 0;
+    result->sum    = 0;
+    result->count  = 0;
+#ifdef PEAKS_X86
+    // Resolved once, the answer can't change while the process runs
+    static int resolvedLevel = -1;
+    int level = __atomic_load_n(&resolvedLevel, __ATOMIC_RELAXED);
+    if (level < 0)
+    {
+        __builtin_cpu_init();
+        level = __builtin_cpu_supports("avx2") ? 2 : (__builtin_cpu_supports("sse2") ? 1 : 0);
+        __atomic_store_n(&resolvedLevel, level, __ATOMIC_RELAXED);
+    }
+    if (level == 2)
+    {
+        findPeakAVX2(power, width, height, rowStart, result);
+        return;
+    }
+    if (level == 1)
+    {
+        findPeakSSE2(power, width, height, rowStart, result);
+        return;
+    }
+#endif
+    findPeakScalar(power, width, height, rowStart, result);
+}
+
+void scanBin(const descreenReal *power, int width, int height, int row, int column, peakSearch *result)
+{
+    const descreenReal *bin = &power[row*width+column];
+    descreenReal value = *bin;
+    result->sum += value;
+    result->count++;
+    if (value > result->power &&
+        (row == 0 || value > bin[-width]) &&
+        (row == height-1 || value > bin[width]) &&
+        (column == 0 || value > bin[-1]) &&
+        (column == width-1 || value > bin[1]))
+    {
+        result->power  = value;
+        result->column = column;
+        result->row    = row;
+    }
+}
+
+void scanRowEdges(const descreenReal *power, int width, int height, int row, int start,
+                  int vectorStart, int vectorEnd, peakSearch *result)
+{
+    for (int column = start; column < width; column++)
+    {
+        if (column == vectorStart && vectorEnd > vectorStart)
+        {
+            column = vectorEnd-1;
+            continue;
+        }
+        scanBin(power, width, height, row, column, result);
+    }
+}
+
+void findPeakScalar(const descreenReal *power, int width, int height, const int *rowStart, peakSearch *result)
+{
+    for (int row = 0; row < height; row++)
+    {
+        scanRowEdges(power, width, height, row, rowStart[row], 0, 0, result);
+    }
+}
+
+#ifdef PEAKS_X86
+// Every lane keeps its own running maximum and the row major index it was found at,
+// the lanes and the scalar result are merged at the end. Since lanes only replace their
+// maximum with a strictly larger value, taking the smallest index among equal maxima
+// gives the same peak a plain row major scan would.
+static void mergeLane(double power, long position, int width, peakSearch *result)
+{
+    long current = (long)result->row*width+result->column;
+    if (power > result->power || (power == result->power && power > 0 && position < current))
+    {
+        result->power  = power;
+        result->row    = position/width;
+        result->column = position%width;
+    }
+}
+
+#ifdef DESCREEN_FLOAT
+__attribute__((target("sse2")))
+void findPeakSSE2(const descreenReal *power, int width, int height, const int *rowStart, peakSearch *result)
+{
+    // Single precision indices would run out of precision on large windows,
+    // so lanes track them as 32-bit integers instead
+    __m128  best = _mm_setzero_ps();
+    __m128i bestIndex = _mm_setzero_si128();
+    // Sums are kept in double precision, float sums lose bins on large windows
+    __m128d sum = _mm_setzero_pd();
+    for (int row = 0; row < height; row++)
+    {
+        int start = rowStart[row];
+        // The vector loop needs all 4 neighbours, so it skips the first and last rows and columns
+        int vectorStart = start > 1 ? start : 1,
+            vectorEnd = vectorStart;
+        if (row > 0 && row < height-1)
+        {
+            const descreenReal *center = &power[row*width];
+            __m128i index = _mm_add_epi32(_mm_set1_epi32(row*width+vectorStart), _mm_set_epi32(3, 2, 1, 0));
+            const __m128i step = _mm_set1_epi32(4);
+            for (; vectorEnd+4 <= width-1; vectorEnd += 4)
+            {
+                __m128 value = _mm_loadu_ps(center+vectorEnd);
+                __m128 peak = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(value, _mm_loadu_ps(center+vectorEnd-width)),
+                                                    _mm_cmpgt_ps(value, _mm_loadu_ps(center+vectorEnd+width))),
+                                         _mm_and_ps(_mm_cmpgt_ps(value, _mm_loadu_ps(center+vectorEnd-1)),
+                                                    _mm_cmpgt_ps(value, _mm_loadu_ps(center+vectorEnd+1))));
+                __m128 better = _mm_and_ps(peak, _mm_cmpgt_ps(value, best));
+                __m128i betterIndex = _mm_castps_si128(better);
+                best      = _mm_or_ps(_mm_and_ps(better, value), _mm_andnot_ps(better, best));
+                bestIndex = _mm_or_si128(_mm_and_si128(betterIndex, index), _mm_andnot_si128(betterIndex, bestIndex));
+                sum   = _mm_add_pd(sum, _mm_add_pd(_mm_cvtps_pd(value), _mm_cvtps_pd(_mm_movehl_ps(value, value))));
+                index = _mm_add_epi32(index, step);
+            }
+            result->count += vectorEnd-vectorStart;
+        }
+        scanRowEdges(power, width, height, row, start, vectorStart, vectorEnd, result);
+    }
+
+    float lanes[4];
+    int indices[4];
+    double sums[2];
+    _mm_storeu_ps(lanes, best);
+    _mm_storeu_si128((__m128i *)indices, bestIndex);
+    _mm_storeu_pd(sums, sum);
+    for (int lane = 0; lane < 4; lane++)
+    {
+        mergeLane(lanes[lane], indices[lane], width, result);
+    }
+    result->sum += sums[0]+sums[1];
+}
+
+__attribute__((target("avx2")))
+void findPeakAVX2(const descreenReal *power, int width, int height, const int *rowStart, peakSearch *result)
+{
+    __m256  best = _mm256_setzero_ps();
+    __m256i bestIndex = _mm256_setzero_si256();
+    __m256d sum = _mm256_setzero_pd();
+    for (int row = 0; row < height; row++)
+    {
+        int start = rowStart[row];
+        int vectorStart = start > 1 ? start : 1,
+            vectorEnd = vectorStart;
+        if (row > 0 && row < height-1)
+        {
+            const descreenReal *center = &power[row*width];
+            __m256i index = _mm256_add_epi32(_mm256_set1_epi32(row*width+vectorStart), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+            const __m256i step = _mm256_set1_epi32(8);
+            for (; vectorEnd+8 <= width-1; vectorEnd += 8)
+            {
+                __m256 value = _mm256_loadu_ps(center+vectorEnd);
+                __m256 peak = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(value, _mm256_loadu_ps(center+vectorEnd-width), _CMP_GT_OQ),
+                                                          _mm256_cmp_ps(value, _mm256_loadu_ps(center+vectorEnd+width), _CMP_GT_OQ)),
+                                            _mm256_and_ps(_mm256_cmp_ps(value, _mm256_loadu_ps(center+vectorEnd-1), _CMP_GT_OQ),
+                                                          _mm256_cmp_ps(value, _mm256_loadu_ps(center+vectorEnd+1), _CMP_GT_OQ)));
+                __m256 better = _mm256_and_ps(peak, _mm256_cmp_ps(value, best, _CMP_GT_OQ));
+                best      = _mm256_blendv_ps(best, value, better);
+                bestIndex = _mm256_blendv_epi8(bestIndex, index, _mm256_castps_si256(better));
+                sum   = _mm256_add_pd(sum, _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(value)),
+                                                         _mm256_cvtps_pd(_mm256_extractf128_ps(value, 1))));
+                index = _mm256_add_epi32(index, step);
+            }
+            result->count += vectorEnd-vectorStart;
+        }
+        scanRowEdges(power, width, height, row, start, vectorStart, vectorEnd, result);
+    }
+
+    float lanes[8];
+    int indices[8];
+    double sums[4];
+    _mm256_storeu_ps(lanes, best);
+    _mm256_storeu_si256((__m256i *)indices, bestIndex);
+    _mm256_storeu_pd(sums, sum);
+    for (int lane = 0; lane < 8; lane++)
+    {
+        mergeLane(lanes[lane], indices[lane], width, result);
+    }
+    result->sum += sums[0]+sums[1]+sums[2]+sums[3];
+}
+#else
+__attribute__((target("sse2")))
+void findPeakSSE2(const descreenReal *power, int width, int height, const int *rowStart, peakSearch *result)
+{
+    __m128d best  = _mm_setzero_pd(),
+            bestIndex = _mm_setzero_pd(),
+            sum   = _mm_setzero_pd();
+    for (int row = 0; row < height; row++)
+    {
+        int start = rowStart[row];
+        // The vector loop needs all 4 neighbours, so it skips the first and last rows and columns
+        int vectorStart = start > 1 ? start : 1,
+            vectorEnd = vectorStart;
+        if (row > 0 && row < height-1)
+        {
+            const double *center = &power[row*width];
+            __m128d index = _mm_set_pd((double)row*width+vectorStart+1, (double)row*width+vectorStart);
+            const __m128d step = _mm_set1_pd(2);
+            for (; vectorEnd+2 <= width-1; vectorEnd += 2)
+            {
+                __m128d value = _mm_loadu_pd(center+vectorEnd);
+                __m128d peak = _mm_and_pd(_mm_and_pd(_mm_cmpgt_pd(value, _mm_loadu_pd(center+vectorEnd-width)),
+                                                     _mm_cmpgt_pd(value, _mm_loadu_pd(center+vectorEnd+width))),
+                                          _mm_and_pd(_mm_cmpgt_pd(value, _mm_loadu_pd(center+vectorEnd-1)),
+                                                     _mm_cmpgt_pd(value, _mm_loadu_pd(center+vectorEnd+1))));
+                __m128d better = _mm_and_pd(peak, _mm_cmpgt_pd(value, best));
+                best      = _mm_or_pd(_mm_and_pd(better, value), _mm_andnot_pd(better, best));
+                bestIndex = _mm_or_pd(_mm_and_pd(better, index), _mm_andnot_pd(better, bestIndex));
+                sum   = _mm_add_pd(sum, value);
+                index = _mm_add_pd(index, step);
+            }
+            result->count += vectorEnd-vectorStart;
+        }
+        scanRowEdges(power, width, height, row, start, vectorStart, vectorEnd, result);
+    }
+
+    double lanes[2], indices[2], sums[2];
+    _mm_storeu_pd(lanes, best);
+    _mm_storeu_pd(indices, bestIndex);
+    _mm_storeu_pd(sums, sum);
+    for (int lane = 0; lane < 2; lane++)
+    {
+        mergeLane(lanes[lane], (long)indices[lane], width, result);
+        result->sum += sums[lane];
+    }
+}
+
+__attribute__((target("avx2")))
+void findPeakAVX2(const descreenReal *power, int width, int height, const int *rowStart, peakSearch *result)
+{
+    __m256d best  = _mm256_setzero_pd(),
+            bestIndex = _mm256_setzero_pd(),
+            sum   = _mm256_setzero_pd();
+    for (int row = 0; row < height; row++)
+    {
+        int start = rowStart[row];
+        int vectorStart = start > 1 ? start : 1,
+            vectorEnd = vectorStart;
+        if (row > 0 && row < height-1)
+        {
+            const double *center = &power[row*width];
+            __m256d index = _mm256_add_pd(_mm256_set1_pd((double)row*width+vectorStart), _mm256_set_pd(3, 2, 1, 0));
+            const __m256d step = _mm256_set1_pd(4);
+            for (; vectorEnd+4 <= width-1; vectorEnd += 4)
+            {
+                __m256d value = _mm256_loadu_pd(center+vectorEnd);
+                __m256d peak = _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(value, _mm256_loadu_pd(center+vectorEnd-width), _CMP_GT_OQ),
+                                                           _mm256_cmp_pd(value, _mm256_loadu_pd(center+vectorEnd+width), _CMP_GT_OQ)),
+                                             _mm256_and_pd(_mm256_cmp_pd(value, _mm256_loadu_pd(center+vectorEnd-1), _CMP_GT_OQ),
+                                                           _mm256_cmp_pd(value, _mm256_loadu_pd(center+vectorEnd+1), _CMP_GT_OQ)));
+                __m256d better = _mm256_and_pd(peak, _mm256_cmp_pd(value, best, _CMP_GT_OQ));
+                best      = _mm256_blendv_pd(best, value, better);
+                bestIndex = _mm256_blendv_pd(bestIndex, index, better);
+                sum   = _mm256_add_pd(sum, value);
+                index = _mm256_add_pd(index, step);
+            }
+            result->count += vectorEnd-vectorStart;
+        }
+        scanRowEdges(power, width, height, row, start, vectorStart, vectorEnd, result);
+    }
+
+    double lanes[4], indices[4], sums[4];
+    _mm256_storeu_pd(lanes, best);
+    _mm256_storeu_pd(indices, bestIndex);
+    _mm256_storeu_pd(sums, sum);
+    for (int lane = 0; lane < 4; lane++)
+    {
+        mergeLane(lanes[lane], (long)indices[lane], width, result);
+        result->sum += sums[lane];
+    }
+}
+#endif // DESCREEN_FLOAT
+#endif
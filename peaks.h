@@ -0,0 +1,26 @@
+#ifndef PEAKS_H_INCLUDED
+#define PEAKS_H_INCLUDED
+
+#include "precision.h"
+
+// Result of a peak search over a squared magnitude plane
+typedef struct
+{
+    // Largest peak found and its position, power is 0 if no peak was found
+    double power;
+    int column;
+    int row;
+    // Sum of every searched bin and how many bins were searched
+    double sum;
+    long count;
+} peakSearch;
+
+// findPeak() will search a width x height plane of squared magnitudes (rows are width
+// values apart) for its largest peak, a bin that is larger than each of its 4 neighbours
+// (neighbours outside the plane are ignored). Bins in row r before column rowStart[r]
+// are excluded from the search, which is used to leave out the DC component.
+// If several peaks share the largest value, the first one in row major order is returned.
+// The search runs in a single pass, using AVX2 or SSE2 when the CPU supports them.
+void findPeak(const descreenReal *power, int width, int height, const int *rowStart, peakSearch *result);
+
+#endif // PEAKS_H_INCLUDED
@@ -0,0 +1,15 @@
+#ifndef PRECISION_H_INCLUDED
+#define PRECISION_H_INCLUDED
+
+// Transform buffers, spectra and masks are single precision when built with
+// -DDESCREEN_FLOAT (linking fftw3f instead of fftw3), which halves the working set
+// of every window. 8-bit input doesn't need more than float provides.
+#ifdef DESCREEN_FLOAT
+    typedef float descreenReal;
+    #define FFTW(name) fftwf_##name
+#else
+    typedef double descreenReal;
+    #define FFTW(name) fftw_##name
+#endif
+
+#endif // PRECISION_H_INCLUDED
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "descreen.h"
+
+// Single begin ('B') or end ('E') event
+typedef struct
+{
+    const char *name;
+    char phase;
+    // Index of the recording thread in the order threads were first seen
+    int thread;
+    // Microseconds since the trace was created
+    double time;
+    long long id;
+} traceEvent;
+
+struct descreenTrace
+{
+    pthread_mutex_t lock;
+    double start;
+    traceEvent *events;
+    size_t count;
+    size_t capacity;
+    // Every thread that has recorded an event, its index is the tid written for it
+    pthread_t *threads;
+    int threadCount;
+    int threadCapacity;
+    // Set once an event could not be stored, it is written as an instant event at the end of the trace
+    int dropped;
+};
+
+// Appends an event of the calling thread to *trace, does nothing if trace is NULL
+static void recordEvent(descreenTrace *trace, const char *name, char phase, long long id);
+// Returns the index of the calling thread in *trace, adding it if it is new, or -1 if out of memory.
+// The caller must hold trace->lock.
+static int threadIndex(descreenTrace *trace);
+
+descreenTrace *descreenTraceCreate(void)
+{
+    descreenTrace *trace = calloc(1, sizeof(descreenTrace));
+    if (trace == NULL)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&trace->lock, NULL);
+    trace->start = descreenStatsTime();
+    return trace;
+}
+
+void descreenTraceBegin(descreenTrace *trace, const char *name, long long id)
+{
+    recordEvent(trace, name, 'B', id);
+}
+
+void descreenTraceEnd(descreenTrace *trace, const char *name)
+{
+    recordEvent(trace, name, 'E', -1);
+}
+
+int descreenTraceWrite(const descreenTrace *trace, const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    fprintf(file, "{\"traceEvents\": [\n");
+    for (size_t event = 0; event < trace->count; event++)
+    {
+        const traceEvent *current = &trace->events[event];
+        fprintf(file, "{\"name\": \"%s\", \"cat\": \"descreen\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": 1, \"tid\": %i",
+                current->name, current->phase, current->time, current->thread);
+        if (current->id >= 0)
+        {
+            fprintf(file, ", \"args\": {\"id\": %lld}", current->id);
+        }
+        fprintf(file, "}%s\n", event+1 < trace->count ? "," : "");
+    }
+    if (trace->dropped)
+    {
+        fprintf(file, "%s{\"name\": \"events dropped, out of memory\", \"ph\": \"i\", \"s\": \"g\", \"ts\": 0, \"pid\": 1, \"tid\": 0}\n",
+                trace->count > 0 ? "," : "");
+    }
+    fprintf(file, "], \"displayTimeUnit\": \"ms\"}\n");
+    int written = ferror(file) == 0;
+    return fclose(file) == 0 && written;
+}
+
+void descreenTraceDestroy(descreenTrace *trace)
+{
+    if (trace == NULL)
+    {
+        return;
+    }
+    pthread_mutex_destroy(&trace->lock);
+    free(trace->threads);
+    free(trace->events);
+    free(trace);
+}
+
+void recordEvent(descreenTrace *trace, const char *name, char phase, long long id)
+{
+    if (trace == NULL)
+    {
+        return;
+    }
+    double time = (descreenStatsTime()-trace->start)*1e6;
+    pthread_mutex_lock(&trace->lock);
+    int thread = threadIndex(trace);
+    if (trace->count == trace->capacity && thread >= 0)
+    {
+        size_t capacity = trace->capacity ? trace->capacity*2 : 4096;
+        traceEvent *grown = realloc(trace->events, sizeof(traceEvent)*capacity);
+        if (grown != NULL)
+        {
+            trace->events = grown;
+            trace->capacity = capacity;
+        }
+    }
+    if (trace->count < trace->capacity && thread >= 0)
+    {
+        traceEvent *event = &trace->events[trace->count++];
+        event->name   = name;
+        event->phase  = phase;
+        event->thread = thread;
+        event->time   = time;
+        event->id     = id;
+    } else
+    {
+        trace->dropped = 1;
+    }
+    pthread_mutex_unlock(&trace->lock);
+}
+
+int threadIndex(descreenTrace *trace)
+{
+    pthread_t self = pthread_self();
+    // Only a handful of threads ever record, so a linear search is enough
+    for (int thread = 0; thread < trace->threadCount; thread++)
+    {
+        if (pthread_equal(trace->threads[thread], self))
+        {
+            return thread;
+        }
+    }
+    if (trace->threadCount == trace->threadCapacity)
+    {
+        int capacity = trace->threadCapacity ? trace->threadCapacity*2 : 16;
+        pthread_t *grown = realloc(trace->threads, sizeof(pthread_t)*capacity);
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        trace->threads = grown;
+        trace->threadCapacity = capacity;
+    }
+    trace->threads[trace->threadCount] = self;
+    return trace->threadCount++;
+}